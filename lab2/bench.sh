@@ -0,0 +1,126 @@
+#!/bin/bash
+#
+# Benchmarks of the shell. Every workload is run with the built
+# ./shell and appended to a CSV file (bench.csv by default), one
+# line per run, so results of different commits can be compared.
+#
+# Sizes can be reduced for a quick run, e.g.
+#   BENCH_SPAWN=1000 BENCH_BYTES=64M ./bench.sh
+
+set -e
+
+cd "$(dirname "$0")"
+
+SHELL_BIN=./shell
+OUT=${BENCH_OUT:-bench.csv}
+
+# commands in the spawn rate script
+SPAWN=${BENCH_SPAWN:-100000}
+# bytes pushed through a pipeline
+BYTES=${BENCH_BYTES:-4G}
+# stages of the long pipeline
+STAGES=${BENCH_STAGES:-1000}
+# lines of the parse only script
+PARSE=${BENCH_PARSE:-100000}
+# background jobs per burst and number of bursts
+BG=${BENCH_BG:-200}
+BG_BURSTS=${BENCH_BG_BURSTS:-10}
+
+if [ ! -x "$SHELL_BIN" ]; then
+    echo "bench: $SHELL_BIN is not built" >&2
+    exit 1
+fi
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+COMMIT=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+DATE=$(date -u +%Y-%m-%dT%H:%M:%SZ)
+
+if [ ! -s "$OUT" ]; then
+    echo "date,commit,bench,variant,ops,seconds,ops_per_sec" > "$OUT"
+fi
+
+now() {
+    date +%s%N
+}
+
+# run NAME VARIANT OPS SCRIPT [SHELL OPTIONS...]
+run() {
+    local name=$1 variant=$2 ops=$3 script=$4
+    shift 4
+
+    local start end
+    start=$(now)
+    if ! "$SHELL_BIN" "$@" -f "$script" > "$TMP/stdout" 2> "$TMP/stderr"; then
+        echo "bench: $name/$variant failed:" >&2
+        head -5 "$TMP/stderr" >&2
+    fi
+    end=$(now)
+
+    local line
+    line=$(awk -v s="$start" -v e="$end" -v ops="$ops" \
+        'BEGIN { t = (e - s) / 1e9; printf "%.3f,%.1f", t, ops / t }')
+
+    echo "$DATE,$COMMIT,$name,$variant,$ops,$line" >> "$OUT"
+    printf "%-10s %-12s %10s ops %s\n" "$name" "$variant" "$ops" "${line/,/ s, } ops/s"
+}
+
+# spawn rate: a long script of trivial commands
+for i in $(seq "$SPAWN"); do echo "/bin/true $i"; done > "$TMP/spawn_ext.sh"
+for i in $(seq "$SPAWN"); do echo "true $i"; done > "$TMP/spawn_builtin.sh"
+for i in $(seq "$SPAWN"); do echo "/bin/true $i | true"; done > "$TMP/spawn_pipe.sh"
+
+run spawn external "$SPAWN" "$TMP/spawn_ext.sh"
+run spawn zygote "$SPAWN" "$TMP/spawn_ext.sh" -z
+run spawn builtin "$SPAWN" "$TMP/spawn_builtin.sh"
+run spawn pipe2 "$SPAWN" "$TMP/spawn_pipe.sh"
+
+# throughput: bytes per second through a 3-stage pipeline
+BYTES_NUM=$(numfmt --from=iec "$BYTES")
+echo "yes | head -c $BYTES_NUM | wc -c" > "$TMP/pipe.sh"
+printf 'set pipesz 1048576\nyes | head -c %s | wc -c\n' "$BYTES_NUM" > "$TMP/pipe_1m.sh"
+echo "yes | head -c $BYTES_NUM | cat | wc -c" > "$TMP/pipe_cat.sh"
+
+run throughput default "$BYTES_NUM" "$TMP/pipe.sh"
+run throughput pipesz-1m "$BYTES_NUM" "$TMP/pipe_1m.sh"
+run throughput builtin-cat "$BYTES_NUM" "$TMP/pipe_cat.sh"
+
+# fd scaling: one pipeline with many stages
+{
+    printf 'echo x'
+    for i in $(seq "$STAGES"); do printf ' | /bin/cat'; done
+    echo
+} > "$TMP/stages_ext.sh"
+{
+    printf 'echo x'
+    for i in $(seq "$STAGES"); do printf ' | cat'; done
+    echo
+} > "$TMP/stages_builtin.sh"
+
+run stages external "$STAGES" "$TMP/stages_ext.sh"
+run stages zygote "$STAGES" "$TMP/stages_ext.sh" -z
+run stages builtin "$STAGES" "$TMP/stages_builtin.sh"
+
+# parser throughput: quoting and escaping, lines are unique so
+# the parse cache does not help
+awk -v n="$PARSE" 'BEGIN {
+    for (i = 1; i <= n; ++i) {
+        printf "echo \"a|b&&c %d\" '"'"'x || y'"'"' \\\\\\| \"q\\\"q\" ", i
+        printf "| grep -v '"'"'\"&\"'"'"' \"%d\"\\ z >> \"/tmp/o %d\" && ", i, i
+        printf "printf '"'"'%%s\\\\n'"'"' a\\\\ b \"c'"'"'d\" || true &\n"
+    }
+}' > "$TMP/parse.sh"
+
+run parse quoting "$PARSE" "$TMP/parse.sh" -n
+
+# background jobs: bursts of jobs, each burst is waited for
+for b in $(seq "$BG_BURSTS"); do
+    for i in $(seq "$BG"); do echo "/bin/true $b $i &"; done
+    echo wait
+done > "$TMP/bg.sh"
+
+run background bursts "$((BG * BG_BURSTS))" "$TMP/bg.sh"
+run background zygote "$((BG * BG_BURSTS))" "$TMP/bg.sh" -z
+
+echo "results are appended to $OUT"
@@ -0,0 +1,437 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/sendfile.h>
+
+#include "builtins.h"
+#include "runner.h"
+#include "jobs.h"
+#include "parallel.h"
+
+// bytes moved by one splice/sendfile call
+#define COPY_CHUNK (1 << 20)
+
+static bool printf_accepts(char **argv, int argc);
+
+static bool echo_accepts(char **argv, int argc);
+
+static bool cat_accepts(char **argv, int argc);
+
+static const struct builtin builtins[] = {
+    {"cd", builtin_cd, BUILTIN_SPECIAL},
+    {"exit", builtin_exit, BUILTIN_SPECIAL},
+    {"hash", builtin_hash, BUILTIN_SPECIAL},
+    {"set", builtin_set, BUILTIN_SPECIAL},
+    {"jobs", builtin_jobs, BUILTIN_SPECIAL},
+    {"fg", builtin_fg, BUILTIN_SPECIAL},
+    {"bg", builtin_bg, BUILTIN_SPECIAL},
+    {"wait", builtin_wait, BUILTIN_SPECIAL},
+    {"parallel", builtin_parallel, BUILTIN_FAST | BUILTIN_READS_INPUT},
+    {"true", builtin_true, BUILTIN_FAST},
+    {":", builtin_true, BUILTIN_FAST},
+    {"false", builtin_false, BUILTIN_FAST},
+    {"echo", builtin_echo, BUILTIN_FAST, echo_accepts},
+    {"printf", builtin_printf, BUILTIN_FAST, printf_accepts},
+    {"cat", builtin_cat, BUILTIN_FAST | BUILTIN_READS_INPUT, cat_accepts},
+};
+
+const struct builtin *find_builtin(char **argv, int argc) {
+    for (int i = 0; i < sizeof(builtins) / sizeof(builtins[0]); ++i) {
+        const struct builtin *b = &builtins[i];
+        if (strcmp(b->name, argv[0]))
+            continue;
+        return !b->accepts || b->accepts(argv, argc) ? b : NULL;
+    }
+    return NULL;
+}
+
+
+/* output is collected in memory and written with a single call */
+struct outbuf {
+    char *data;
+    size_t size;
+    size_t capacity;
+};
+
+static void buf_put(struct outbuf *b, const char *data, size_t size) {
+    if (b->size + size > b->capacity) {
+        b->capacity = (b->size + size) * 2;
+        b->data = realloc(b->data, b->capacity);
+    }
+    memcpy(b->data + b->size, data, size);
+    b->size += size;
+}
+
+static void buf_putc(struct outbuf *b, char c) {
+    buf_put(b, &c, 1);
+}
+
+static void buf_printf(struct outbuf *b, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+
+    if (len <= 0)
+        return;
+
+    char *str = malloc(len + 1);
+    va_start(ap, fmt);
+    vsnprintf(str, len + 1, fmt, ap);
+    va_end(ap);
+
+    buf_put(b, str, len);
+    free(str);
+}
+
+static int write_all(int fd, const char *data, size_t size) {
+    while (size) {
+        ssize_t n = write(fd, data, size);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static int buf_flush(struct outbuf *b, int out, const char *builtin) {
+    int ret = 0;
+    if (write_all(out, b->data, b->size)) {
+        fprintf(stderr, "%s: write error: %s\n", builtin, strerror(errno));
+        ret = 1;
+    }
+    free(b->data);
+    return ret;
+}
+
+// puts escape sequence starting at @p, returns its last char
+static const char *put_escape(struct outbuf *b, const char *p) {
+    switch (p[1]) {
+        case 'n': buf_putc(b, '\n'); break;
+        case 't': buf_putc(b, '\t'); break;
+        case 'r': buf_putc(b, '\r'); break;
+        case 'a': buf_putc(b, '\a'); break;
+        case 'b': buf_putc(b, '\b'); break;
+        case 'f': buf_putc(b, '\f'); break;
+        case 'v': buf_putc(b, '\v'); break;
+        case '\\': buf_putc(b, '\\'); break;
+
+        case '0': case '1': case '2': case '3':
+        case '4': case '5': case '6': case '7': {
+            // up to 3 octal digits
+            int value = 0, digits = 0;
+            while (digits < 3 && p[1] >= '0' && p[1] <= '7') {
+                value = value * 8 + (p[1] - '0');
+                ++p;
+                ++digits;
+            }
+            buf_putc(b, (char) value);
+            return p;
+        }
+
+        case '\0':
+            buf_putc(b, '\\');
+            return p;
+
+        default:
+            buf_putc(b, '\\');
+            buf_putc(b, p[1]);
+    }
+    return p + 1;
+}
+
+int builtin_true(char **argv, int argc, int in, int out) {
+    return 0;
+}
+
+int builtin_false(char **argv, int argc, int in, int out) {
+    return 1;
+}
+
+// parses options of echo, returns index of the first word
+static int echo_options(char **argv, int argc, bool *newline, bool *escapes) {
+    *newline = true;
+    *escapes = false;
+
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1]; ++i) {
+        // only -n, -e and -E are options, the rest is printed
+        if (strspn(argv[i] + 1, "neE") != strlen(argv[i] + 1))
+            break;
+
+        for (const char *o = argv[i] + 1; *o; ++o) {
+            if (*o == 'n')
+                *newline = false;
+            else
+                *escapes = *o == 'e';
+        }
+    }
+    return i;
+}
+
+// echo -e of coreutils differs from printf in octals (\0NNN) and
+// has \c, \x, \e; those go to the external echo, the builtin knows only
+// the single letter ones of put_escape()
+static bool echo_accepts(char **argv, int argc) {
+    bool newline, escapes;
+    int i = echo_options(argv, argc, &newline, &escapes);
+    if (!escapes)
+        return true;
+
+    for (; i < argc; ++i) {
+        for (const char *p = strchr(argv[i], '\\'); p; p = strchr(p + 2, '\\')) {
+            if (!p[1])
+                break;
+            if (!strchr("ntrabfv\\", p[1]))
+                return false;
+        }
+    }
+    return true;
+}
+
+int builtin_echo(char **argv, int argc, int in, int out) {
+    bool newline, escapes;
+    int i = echo_options(argv, argc, &newline, &escapes);
+
+    struct outbuf buf = {0};
+    for (int first = i; i < argc; ++i) {
+        if (i > first)
+            buf_putc(&buf, ' ');
+
+        if (!escapes) {
+            buf_put(&buf, argv[i], strlen(argv[i]));
+            continue;
+        }
+
+        for (const char *p = argv[i]; *p; ++p) {
+            if (*p == '\\')
+                p = put_escape(&buf, p);
+            else
+                buf_putc(&buf, *p);
+        }
+    }
+
+    if (newline)
+        buf_putc(&buf, '\n');
+
+    return buf_flush(&buf, out, "echo");
+}
+
+// the builtin knows escapes of put_escape() and integer and string
+// directives; floats, %b, * widths and the rest go to /usr/bin/printf
+static bool printf_accepts(char **argv, int argc) {
+    if (argc < 2)
+        return true;
+
+    for (const char *p = argv[1]; *p; ++p) {
+        if (*p == '\\') {
+            if (!p[1] || !strchr("ntrabfv\\01234567", p[1]))
+                return false;
+            ++p;
+            continue;
+        }
+
+        if (*p != '%')
+            continue;
+
+        if (p[1] == '%') {
+            ++p;
+            continue;
+        }
+
+        p += strspn(p + 1, "-+ #0123456789.") + 1;
+        if (!*p || !strchr("sciduxXo", *p))
+            return false;
+    }
+    return true;
+}
+
+int builtin_printf(char **argv, int argc, int in, int out) {
+    if (argc < 2) {
+        fprintf(stderr, "printf: usage: printf FORMAT [ARGUMENT]...\n");
+        return 1;
+    }
+
+    const char *fmt = argv[1];
+    int arg = 2;
+    int ret = 0;
+    struct outbuf buf = {0};
+
+    // format is reused until all arguments are consumed
+    while (true) {
+        int first_arg = arg;
+
+        for (const char *p = fmt; *p; ++p) {
+            if (*p == '\\') {
+                p = put_escape(&buf, p);
+                continue;
+            }
+
+            if (*p != '%') {
+                buf_putc(&buf, *p);
+                continue;
+            }
+
+            if (p[1] == '%') {
+                buf_putc(&buf, '%');
+                ++p;
+                continue;
+            }
+
+            // copy flags, width and precision, then add the
+            // length modifier for the conversion
+            char spec[32] = "%";
+            size_t len = strspn(p + 1, "-+ #0123456789.");
+            if (len > sizeof(spec) - 5)
+                len = sizeof(spec) - 5;
+            memcpy(spec + 1, p + 1, len);
+            p += len + 1;
+
+            const char *value = arg < argc ? argv[arg++] : "";
+
+            switch (*p) {
+                case 's':
+                    strcat(spec, "s");
+                    buf_printf(&buf, spec, value);
+                    break;
+
+                case 'c':
+                    // no argument prints nothing, as an empty %s
+                    strcat(spec, value[0] ? "c" : "s");
+                    if (value[0])
+                        buf_printf(&buf, spec, value[0]);
+                    else
+                        buf_printf(&buf, spec, "");
+                    break;
+
+                case 'd':
+                case 'i':
+                    strcat(spec, "lld");
+                    buf_printf(&buf, spec, strtoll(value, NULL, 0));
+                    break;
+
+                case 'u':
+                case 'x':
+                case 'X':
+                case 'o': {
+                    size_t spec_len = strlen(spec);
+                    spec[spec_len] = 'l';
+                    spec[spec_len + 1] = 'l';
+                    spec[spec_len + 2] = *p;
+                    spec[spec_len + 3] = '\0';
+                    buf_printf(&buf, spec, strtoull(value, NULL, 0));
+                    break;
+                }
+
+                default:
+                    fprintf(stderr, "printf: %%%c: invalid directive\n", *p ? *p : ' ');
+                    free(buf.data);
+                    return 1;
+            }
+        }
+
+        if (arg >= argc || arg == first_arg)
+            break;
+    }
+
+    if (buf_flush(&buf, out, "printf"))
+        ret = 1;
+    return ret;
+}
+
+// moves all data from @in to @out, avoiding user space copies
+// where the kernel allows it
+static int copy_fd(int in, int out) {
+    // splice works when one of the ends is a pipe
+    while (true) {
+        ssize_t n = splice(in, NULL, out, NULL, COPY_CHUNK, SPLICE_F_MOVE);
+        if (n == 0)
+            return 0;
+        if (n > 0)
+            continue;
+        if (errno == EINTR)
+            continue;
+        if (errno != EINVAL)
+            return -1;
+        break;
+    }
+
+    // sendfile needs a regular file as a source
+    while (true) {
+        ssize_t n = sendfile(out, in, NULL, COPY_CHUNK);
+        if (n == 0)
+            return 0;
+        if (n > 0)
+            continue;
+        if (errno == EINTR)
+            continue;
+        if (errno != EINVAL && errno != ENOSYS)
+            return -1;
+        break;
+    }
+
+    char data[1 << 16];
+    while (true) {
+        ssize_t n = read(in, data, sizeof(data));
+        if (n == 0)
+            return 0;
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (write_all(out, data, n))
+            return -1;
+    }
+}
+
+// options like -n or -A are left to /usr/bin/cat
+static bool cat_accepts(char **argv, int argc) {
+    for (int i = 1; i < argc; ++i)
+        if (argv[i][0] == '-' && argv[i][1])
+            return false;
+    return true;
+}
+
+int builtin_cat(char **argv, int argc, int in, int out) {
+    if (argc < 2) {
+        if (copy_fd(in, out)) {
+            fprintf(stderr, "cat: %s\n", strerror(errno));
+            return 1;
+        }
+        return 0;
+    }
+
+    int ret = 0;
+    for (int i = 1; i < argc; ++i) {
+        int fd = in;
+        if (strcmp(argv[i], "-")) {
+            fd = open(argv[i], O_RDONLY | O_CLOEXEC);
+            if (fd == -1) {
+                fprintf(stderr, "cat: %s: %s\n", argv[i], strerror(errno));
+                ret = 1;
+                continue;
+            }
+        }
+
+        if (copy_fd(fd, out)) {
+            fprintf(stderr, "cat: %s: %s\n", argv[i], strerror(errno));
+            ret = 1;
+        }
+
+        if (fd != in)
+            close(fd);
+    }
+
+    return ret;
+}
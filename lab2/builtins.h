@@ -0,0 +1,52 @@
+#ifndef BUILTINS_H
+#define BUILTINS_H
+
+#include <stdbool.h>
+
+/*
+ * Builtins get their input and output as file descriptors, so
+ * the same code runs in the shell process and in a forked child
+ * of a pipeline.
+ */
+typedef int (*builtin_f)(char **argv, int argc, int in, int out);
+
+// tells if the builtin can do what the arguments ask, otherwise
+// the external command of the same name runs
+typedef bool (*builtin_accepts_f)(char **argv, int argc);
+
+enum builtin_flags {
+    // changes the shell state, runs in the shell itself when
+    // it is the only command of a foreground pipeline
+    BUILTIN_SPECIAL = 1,
+    // does not touch the shell state, runs in the shell itself
+    // as the last stage of a foreground pipeline
+    BUILTIN_FAST = 2,
+    // reads the input; from an interactive terminal it is forked
+    // into its own group, so Ctrl-C and Ctrl-Z reach it, not the
+    // shell
+    BUILTIN_READS_INPUT = 4,
+};
+
+struct builtin {
+    const char *name;
+    builtin_f func;
+    int flags;
+    // NULL if the builtin takes any arguments
+    builtin_accepts_f accepts;
+};
+
+// returns NULL if there is no builtin for the command or it
+// does not support the arguments
+const struct builtin *find_builtin(char **argv, int argc);
+
+int builtin_true(char **argv, int argc, int in, int out);
+
+int builtin_false(char **argv, int argc, int in, int out);
+
+int builtin_echo(char **argv, int argc, int in, int out);
+
+int builtin_printf(char **argv, int argc, int in, int out);
+
+int builtin_cat(char **argv, int argc, int in, int out);
+
+#endif /* BUILTINS_H */
@@ -0,0 +1,258 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "cmdhash.h"
+
+#define CMDHASH_BUCKETS 256
+
+// used by execvp when PATH is not set
+#define DEFAULT_PATH "/bin:/usr/bin"
+
+struct cmdhash_entry {
+    char *name;
+    char *path;
+    // index of PATH directory the command was found in
+    int dir_idx;
+    unsigned int hits;
+    struct cmdhash_entry *next;
+};
+
+static struct cmdhash_entry *buckets[CMDHASH_BUCKETS];
+
+// PATH value the table was built for, split into directories
+static char *path_env = NULL;
+static char **path_dirs = NULL;
+static int num_path_dirs = 0;
+
+// mtimes of PATH directories, valid if mtime_known is set
+static struct timespec *dir_mtimes = NULL;
+static bool *mtime_known = NULL;
+
+static bool check_mtime = false;
+
+
+static unsigned int hash_name(const char *name) {
+    // FNV-1a
+    unsigned int h = 2166136261u;
+    for (; *name; ++name) {
+        h ^= (unsigned char) *name;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void free_path_dirs(void) {
+    for (int i = 0; i < num_path_dirs; ++i)
+        free(path_dirs[i]);
+    free(path_dirs);
+    free(dir_mtimes);
+    free(mtime_known);
+    free(path_env);
+
+    path_dirs = NULL;
+    dir_mtimes = NULL;
+    mtime_known = NULL;
+    path_env = NULL;
+    num_path_dirs = 0;
+}
+
+static void split_path(const char *env) {
+    path_env = strdup(env);
+
+    const char *p = env;
+    while (true) {
+        const char *end = strchr(p, ':');
+        size_t len = end ? (size_t) (end - p) : strlen(p);
+
+        path_dirs = realloc(path_dirs, sizeof(char *) * (++num_path_dirs));
+        // empty element means current directory
+        path_dirs[num_path_dirs - 1] = len ? strndup(p, len) : strdup(".");
+
+        if (!end)
+            break;
+        p = end + 1;
+    }
+
+    dir_mtimes = calloc(num_path_dirs, sizeof(struct timespec));
+    mtime_known = calloc(num_path_dirs, sizeof(bool));
+}
+
+static void drop_entries(void) {
+    for (int i = 0; i < CMDHASH_BUCKETS; ++i) {
+        struct cmdhash_entry *e = buckets[i];
+        while (e) {
+            struct cmdhash_entry *next = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+            e = next;
+        }
+        buckets[i] = NULL;
+    }
+}
+
+static void drop_entry(unsigned int bucket, struct cmdhash_entry *e) {
+    struct cmdhash_entry **link = &buckets[bucket];
+    while (*link != e)
+        link = &(*link)->next;
+    *link = e->next;
+
+    free(e->name);
+    free(e->path);
+    free(e);
+}
+
+void cmdhash_reset(void) {
+    drop_entries();
+    free_path_dirs();
+}
+
+// rebuild table state if PATH was changed since the last lookup
+static void sync_path(void) {
+    const char *env = getenv("PATH");
+    if (!env)
+        env = DEFAULT_PATH;
+
+    if (path_env && !strcmp(path_env, env))
+        return;
+
+    cmdhash_reset();
+    split_path(env);
+}
+
+// returns true if directory was not modified since it was seen
+static bool dir_unchanged(int idx) {
+    struct stat st;
+    if (stat(path_dirs[idx], &st))
+        return false;
+
+    if (!mtime_known[idx]) {
+        dir_mtimes[idx] = st.st_mtim;
+        mtime_known[idx] = true;
+        return true;
+    }
+
+    return dir_mtimes[idx].tv_sec == st.st_mtim.tv_sec
+        && dir_mtimes[idx].tv_nsec == st.st_mtim.tv_nsec;
+}
+
+static struct cmdhash_entry *resolve(const char *name) {
+    for (int i = 0; i < num_path_dirs; ++i) {
+        // relative directories depend on cwd, they are not cached;
+        // a match behind one could be shadowed by it, so execvp
+        // searches the whole PATH itself
+        if (path_dirs[i][0] != '/')
+            return NULL;
+
+        if (check_mtime)
+            dir_unchanged(i); // remember mtime before the lookup
+
+        size_t len = strlen(path_dirs[i]) + strlen(name) + 2;
+        char *path = malloc(len);
+        snprintf(path, len, "%s/%s", path_dirs[i], name);
+
+        struct stat st;
+        if (!stat(path, &st) && S_ISREG(st.st_mode) && !access(path, X_OK)) {
+            struct cmdhash_entry *e = malloc(sizeof(struct cmdhash_entry));
+            *e = (struct cmdhash_entry) {
+                .name = strdup(name),
+                .path = path,
+                .dir_idx = i,
+                .hits = 0,
+                .next = NULL,
+            };
+            return e;
+        }
+
+        free(path);
+    }
+
+    return NULL;
+}
+
+const char *cmdhash_lookup(const char *name) {
+    // explicit paths are never searched in PATH
+    if (strchr(name, '/'))
+        return NULL;
+
+    sync_path();
+
+    unsigned int bucket = hash_name(name) % CMDHASH_BUCKETS;
+    struct cmdhash_entry *e = buckets[bucket];
+
+    while (e && strcmp(e->name, name))
+        e = e->next;
+
+    if (e && check_mtime) {
+        // a new command might have appeared in any directory
+        // before the one where the entry was found
+        for (int i = 0; i <= e->dir_idx; ++i) {
+            if (!dir_unchanged(i)) {
+                drop_entries();
+                memset(mtime_known, 0, sizeof(bool) * num_path_dirs);
+                e = NULL;
+                break;
+            }
+        }
+    }
+
+    // the command could be removed or moved, then execv would fail
+    // on every run before execvp finds it; one access is still
+    // cheaper than a search of PATH
+    if (e && access(e->path, X_OK)) {
+        drop_entry(bucket, e);
+        e = NULL;
+    }
+
+    if (!e) {
+        e = resolve(name);
+        if (!e)
+            return NULL;
+
+        e->next = buckets[bucket];
+        buckets[bucket] = e;
+    }
+
+    ++e->hits;
+    return e->path;
+}
+
+bool cmdhash_add(const char *name) {
+    if (!cmdhash_lookup(name))
+        return false;
+
+    // explicit `hash name` does not count as a hit
+    unsigned int bucket = hash_name(name) % CMDHASH_BUCKETS;
+    for (struct cmdhash_entry *e = buckets[bucket]; e; e = e->next)
+        if (!strcmp(e->name, name))
+            --e->hits;
+
+    return true;
+}
+
+void cmdhash_set_check_mtime(bool enable) {
+    check_mtime = enable;
+    if (mtime_known)
+        memset(mtime_known, 0, sizeof(bool) * num_path_dirs);
+    drop_entries();
+}
+
+void cmdhash_print(int out) {
+    bool empty = true;
+
+    for (int i = 0; i < CMDHASH_BUCKETS; ++i) {
+        for (struct cmdhash_entry *e = buckets[i]; e; e = e->next) {
+            if (empty)
+                dprintf(out, "hits\tcommand\n");
+            empty = false;
+            dprintf(out, "%4u\t%s\n", e->hits, e->path);
+        }
+    }
+
+    if (empty)
+        dprintf(out, "hash: hash table empty\n");
+}
@@ -0,0 +1,25 @@
+#ifndef CMDHASH_H
+#define CMDHASH_H
+
+#include <stdbool.h>
+
+/*
+ * Cache of PATH lookups: command name -> absolute path.
+ * The whole table is dropped when PATH changes. If mtime
+ * revalidation is enabled, entries are also checked against
+ * modification times of the PATH directories they were
+ * resolved through. A cached path which is not executable any
+ * more is dropped and resolved again.
+ */
+
+const char *cmdhash_lookup(const char *name);
+
+bool cmdhash_add(const char *name);
+
+void cmdhash_reset(void);
+
+void cmdhash_set_check_mtime(bool enable);
+
+void cmdhash_print(int out);
+
+#endif /* CMDHASH_H */
@@ -0,0 +1,488 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdio_ext.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "jobs.h"
+#include "trace.h"
+#include "zygote.h"
+#include "ufsredir.h"
+
+// shell controls the terminal and runs jobs in their own groups
+static bool interactive = false;
+static pid_t shell_pgid = 0;
+
+static volatile sig_atomic_t sigchld_pending = 0;
+
+// job table, job with id N is stored at index N - 1
+static struct job **job_table = NULL;
+static int job_table_size = 0;
+
+
+static void sigchld_handler(int sig) {
+    (void) sig;
+    sigchld_pending = 1;
+}
+
+void jobs_init(bool job_control) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigchld_handler;
+    // reading of the command line must not be interrupted
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, NULL);
+
+    interactive = job_control && isatty(STDIN_FILENO)
+        && tcgetpgrp(STDIN_FILENO) == getpgrp();
+
+    if (!interactive)
+        return;
+
+    // terminal stop signals are for jobs, not for the shell
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+
+    shell_pgid = getpgrp();
+}
+
+bool jobs_interactive(void) {
+    return interactive;
+}
+
+struct job *job_new(const char *cmdline, bool own_group) {
+    struct job *j = malloc(sizeof(struct job));
+    *j = (struct job) {
+        .id = 0,
+        .pgid = 0,
+        .own_group = own_group,
+        .procs = NULL,
+        .num_procs = 0,
+        .num_alive = 0,
+        .stopped = false,
+        .timed = false,
+        .parse_us = 0,
+        .cmdline = strdup(cmdline),
+        .ufs_outputs = NULL,
+        .num_ufs_outputs = 0,
+    };
+    return j;
+}
+
+void job_free(struct job *j) {
+    if (!j)
+        return;
+
+    for (int i = 0; i < j->num_procs; ++i)
+        free(j->procs[i].name);
+    free(j->procs);
+    free(j->cmdline);
+    ufs_outputs_free(j);
+    free(j);
+}
+
+static void job_unregister(struct job *j);
+
+// reports and frees a job whose processes are all reaped
+void job_finish(struct job *j) {
+    ufs_outputs_commit(j);
+
+    if (j->timed)
+        time_report(j);
+    trace_job(j);
+
+    if (j->id)
+        job_unregister(j);
+    job_free(j);
+}
+
+static struct job_proc *job_add_proc(struct job *j, pid_t pid, const char *name) {
+    j->procs = realloc(j->procs, sizeof(struct job_proc) * (++j->num_procs));
+
+    struct job_proc *p = &j->procs[j->num_procs - 1];
+    memset(p, 0, sizeof(struct job_proc));
+    p->pid = pid;
+    p->name = strdup(name);
+    return p;
+}
+
+struct job_proc *job_add_pid(struct job *j, pid_t pid, const char *name) {
+    struct job_proc *p = job_add_proc(j, pid, name);
+    ++j->num_alive;
+
+    if (j->own_group) {
+        // child does the same, whoever is first wins the race
+        if (!j->pgid)
+            j->pgid = pid;
+        setpgid(pid, j->pgid);
+    }
+
+    return p;
+}
+
+struct job_proc *job_add_done(struct job *j, const char *name, int status) {
+    struct job_proc *p = job_add_proc(j, 0, name);
+    p->status = status;
+    p->reaped = true;
+
+    // an instant stage, so the job wall time does not start at 0
+    clock_gettime(CLOCK_MONOTONIC, &p->finished);
+    p->fork_start = p->fork_end = p->exec_end = p->finished;
+    return p;
+}
+
+void job_child_setup(struct job *j, bool fg) {
+    if (j->own_group) {
+        pid_t pgid = j->pgid ? j->pgid : getpid();
+        setpgid(0, pgid);
+
+        // take the terminal before exec, or the command may
+        // get SIGTTIN before the shell hands it over
+        if (fg && interactive)
+            tcsetpgrp(STDIN_FILENO, pgid);
+    }
+
+    // command line is read by the parent only; if exit() in the
+    // child flushed stdin, it would move the shared file offset
+    __fpurge(stdin);
+
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+    signal(SIGTTOU, SIG_DFL);
+
+    // jobs of the parent shell are not children of this process
+    for (int i = 0; i < job_table_size; ++i)
+        job_free(job_table[i]);
+    free(job_table);
+    job_table = NULL;
+    job_table_size = 0;
+
+    interactive = false;
+
+    // commands started by the zygote become children of the
+    // parent shell, so this process forks them itself
+    zygote_detach();
+}
+
+static void job_mark(struct job *j, pid_t pid, int status, struct rusage *ru) {
+    for (int i = 0; i < j->num_procs; ++i) {
+        struct job_proc *p = &j->procs[i];
+        if (p->pid != pid || p->reaped)
+            continue;
+
+        if (WIFSTOPPED(status)) {
+            j->stopped = true;
+        } else if (WIFCONTINUED(status)) {
+            j->stopped = false;
+        } else {
+            p->status = status;
+            p->reaped = true;
+            p->rusage = *ru;
+            clock_gettime(CLOCK_MONOTONIC, &p->finished);
+            --j->num_alive;
+        }
+        return;
+    }
+}
+
+// processes were collected by someone else, nothing to wait for
+static void job_mark_lost(struct job *j) {
+    for (int i = 0; i < j->num_procs; ++i)
+        j->procs[i].reaped = true;
+    j->num_alive = 0;
+}
+
+// wait4 is waitpid which also gives resources used by the child
+static pid_t job_waitpid(struct job *j, int *status, int options, struct rusage *ru) {
+    if (j->own_group)
+        return wait4(-j->pgid, status, options, ru);
+
+    // no group to wait on: poll own pids and sleep until the next
+    // SIGCHLD, so processes are still reaped in order they finish
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &old);
+
+    pid_t pid = 0;
+    while (true) {
+        for (int i = 0; i < j->num_procs && !pid; ++i) {
+            if (!j->procs[i].reaped)
+                pid = wait4(j->procs[i].pid, status, options | WNOHANG, ru);
+        }
+
+        if (pid || (options & WNOHANG))
+            break;
+
+        sigsuspend(&old);
+    }
+
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    return pid;
+}
+
+int job_wait(struct job *j, bool fg) {
+    bool tty = fg && interactive && j->own_group && j->num_alive;
+    if (tty)
+        tcsetpgrp(STDIN_FILENO, j->pgid);
+
+    while (j->num_alive > 0) {
+        int status;
+        struct rusage ru;
+        pid_t pid = job_waitpid(j, &status, WUNTRACED, &ru);
+
+        if (pid == -1) {
+            if (errno == EINTR)
+                continue;
+            job_mark_lost(j);
+            break;
+        }
+
+        job_mark(j, pid, status, &ru);
+        if (j->stopped)
+            break;
+    }
+
+    if (tty)
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+
+    if (j->stopped && !j->id) {
+        int id = job_register(j);
+        if (interactive)
+            fprintf(stderr, "\n[%d]+  Stopped\t\t%s\n", id, j->cmdline);
+    }
+
+    return job_status(j);
+}
+
+int job_status(struct job *j) {
+    if (j->stopped)
+        return W_STOPCODE(SIGTSTP);
+
+    // status of the job is the one of its last process
+    return j->num_procs ? j->procs[j->num_procs - 1].status : 0;
+}
+
+int job_register(struct job *j) {
+    // new job gets the id next to the biggest one in use
+    int last = job_table_size;
+    while (last > 0 && !job_table[last - 1])
+        --last;
+
+    if (last == job_table_size) {
+        job_table = realloc(job_table, sizeof(struct job *) * (++job_table_size));
+    }
+
+    job_table[last] = j;
+    j->id = last + 1;
+    return j->id;
+}
+
+static void job_unregister(struct job *j) {
+    job_table[j->id - 1] = NULL;
+    j->id = 0;
+}
+
+bool job_poll(struct job *j) {
+    while (j->num_alive > 0) {
+        int status;
+        struct rusage ru;
+        pid_t pid = job_waitpid(j, &status, WNOHANG | WUNTRACED | WCONTINUED, &ru);
+
+        if (pid == -1 && errno == EINTR)
+            continue;
+        if (pid == -1)
+            job_mark_lost(j);
+        if (pid <= 0)
+            break;
+
+        job_mark(j, pid, status, &ru);
+    }
+
+    return !j->num_alive;
+}
+
+void jobs_update(void) {
+    if (!sigchld_pending)
+        return;
+    sigchld_pending = 0;
+
+    for (int i = 0; i < job_table_size; ++i)
+        if (job_table[i])
+            job_poll(job_table[i]);
+}
+
+int jobs_wait_any(struct job **jobs, int num_jobs) {
+    // SIGCHLD is blocked between the poll and the sleep, so it
+    // can not be lost there
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &old);
+
+    int idx = -1;
+    while (true) {
+        bool any = false;
+        for (int i = 0; i < num_jobs && idx == -1; ++i) {
+            if (!jobs[i])
+                continue;
+
+            any = true;
+            if (job_poll(jobs[i]))
+                idx = i;
+        }
+
+        if (idx != -1 || !any)
+            break;
+
+        sigsuspend(&old);
+    }
+
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    return idx;
+}
+
+void jobs_notify(void) {
+    jobs_update();
+
+    for (int i = 0; i < job_table_size; ++i) {
+        struct job *j = job_table[i];
+        if (!j || j->num_alive)
+            continue;
+
+        if (interactive)
+            fprintf(stderr, "[%d]   Done\t\t%s\n", j->id, j->cmdline);
+
+        job_finish(j);
+    }
+}
+
+// %N or N, without an argument - the most recent job
+static struct job *find_job(char **argv, int argc, const char *builtin) {
+    int id = 0;
+
+    if (argc < 2) {
+        for (int i = 0; i < job_table_size; ++i)
+            if (job_table[i])
+                id = i + 1;
+    } else {
+        const char *spec = argv[1];
+        if (spec[0] == '%')
+            ++spec;
+        sscanf(spec, "%d", &id);
+    }
+
+    if (id <= 0 || id > job_table_size || !job_table[id - 1]) {
+        fprintf(stderr, "%s: %s: no such job\n", builtin,
+                argc < 2 ? "current" : argv[1]);
+        return NULL;
+    }
+
+    return job_table[id - 1];
+}
+
+int job_exit_code(int status) {
+    if (WIFEXITED(status))
+        return WEXITSTATUS(status);
+    if (WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+    if (WIFSTOPPED(status))
+        return 128 + WSTOPSIG(status);
+    return 1;
+}
+
+int builtin_jobs(char **argv, int argc, int in, int out) {
+    jobs_update();
+
+    for (int i = 0; i < job_table_size; ++i) {
+        struct job *j = job_table[i];
+        if (!j)
+            continue;
+
+        const char *state = "Running";
+        if (!j->num_alive)
+            state = "Done";
+        else if (j->stopped)
+            state = "Stopped";
+
+        dprintf(out, "[%d]  %-8s\t%s\n", j->id, state, j->cmdline);
+
+        if (!j->num_alive) {
+            job_finish(j);
+        }
+    }
+
+    return 0;
+}
+
+int builtin_fg(char **argv, int argc, int in, int out) {
+    struct job *j = find_job(argv, argc, "fg");
+    if (!j)
+        return 1;
+
+    dprintf(out, "%s\n", j->cmdline);
+
+    if (j->stopped) {
+        j->stopped = false;
+        kill(j->own_group ? -j->pgid : j->procs[0].pid, SIGCONT);
+    }
+
+    int status = job_wait(j, true);
+    if (!j->num_alive) {
+        job_finish(j);
+    }
+
+    return job_exit_code(status);
+}
+
+int builtin_bg(char **argv, int argc, int in, int out) {
+    struct job *j = find_job(argv, argc, "bg");
+    if (!j)
+        return 1;
+
+    if (!j->stopped) {
+        fprintf(stderr, "bg: job %d already in background\n", j->id);
+        return 0;
+    }
+
+    j->stopped = false;
+    kill(j->own_group ? -j->pgid : j->procs[0].pid, SIGCONT);
+    dprintf(out, "[%d]+ %s &\n", j->id, j->cmdline);
+    return 0;
+}
+
+int builtin_wait(char **argv, int argc, int in, int out) {
+    if (argc >= 2) {
+        struct job *j = find_job(argv, argc, "wait");
+        if (!j)
+            return 127;
+
+        int status = job_wait(j, false);
+        if (!j->num_alive) {
+            job_finish(j);
+        }
+        return job_exit_code(status);
+    }
+
+    int status = 0;
+    for (int i = 0; i < job_table_size; ++i) {
+        struct job *j = job_table[i];
+        if (!j)
+            continue;
+
+        status = job_wait(j, false);
+        if (!j->num_alive) {
+            job_finish(j);
+        }
+    }
+
+    return job_exit_code(status);
+}
@@ -0,0 +1,101 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <stdbool.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+
+struct ufs_output;
+
+struct job_proc {
+    // 0 for a stage which was run by the shell itself
+    pid_t pid;
+    char *name;
+    int status;
+    bool reaped;
+
+    // around fork(), when exec succeeded and when reaped
+    struct timespec fork_start;
+    struct timespec fork_end;
+    struct timespec exec_end;
+    struct timespec finished;
+    struct rusage rusage;
+};
+
+/*
+ * A job is a set of processes started for one pipeline (or for
+ * one background chain of pipelines). Processes of a job are
+ * reaped only with waitpid on the job's process group or on
+ * the job's own pids, so waiting for one job never collects
+ * children of another.
+ */
+struct job {
+    // position in the job table, 0 if job is not there
+    int id;
+    // process group of the job, 0 if it is not created yet
+    pid_t pgid;
+    // job has its own process group, otherwise it stays in
+    // the shell's one and is waited pid by pid
+    bool own_group;
+
+    struct job_proc *procs;
+    int num_procs;
+    int num_alive;
+
+    bool stopped;
+    // report times of the job when it finishes
+    bool timed;
+    // time spent on parsing of the job's command line
+    double parse_us;
+    char *cmdline;
+
+    // ufs: redirect targets, written to userfs when job finishes
+    struct ufs_output *ufs_outputs;
+    int num_ufs_outputs;
+};
+
+void jobs_init(bool job_control);
+
+bool jobs_interactive(void);
+
+struct job *job_new(const char *cmdline, bool own_group);
+
+void job_free(struct job *j);
+
+void job_finish(struct job *j);
+
+struct job_proc *job_add_pid(struct job *j, pid_t pid, const char *name);
+
+// stage finished in the shell process, it only has a status
+struct job_proc *job_add_done(struct job *j, const char *name, int status);
+
+void job_child_setup(struct job *j, bool fg);
+
+int job_wait(struct job *j, bool fg);
+
+// reaps what has finished without blocking, true if job is done
+bool job_poll(struct job *j);
+
+// blocks until one of not NULL @jobs is done, returns its index
+int jobs_wait_any(struct job **jobs, int num_jobs);
+
+int job_status(struct job *j);
+
+int job_exit_code(int status);
+
+int job_register(struct job *j);
+
+void jobs_update(void);
+
+void jobs_notify(void);
+
+int builtin_jobs(char **argv, int argc, int in, int out);
+
+int builtin_fg(char **argv, int argc, int in, int out);
+
+int builtin_bg(char **argv, int argc, int in, int out);
+
+int builtin_wait(char **argv, int argc, int in, int out);
+
+#endif /* JOBS_H */
@@ -1,48 +1,84 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <unistd.h>
 
 #include "parser.h"
 #include "runner.h"
+#include "jobs.h"
+#include "trace.h"
+#include "script.h"
+#include "zygote.h"
 
-int main() {
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-n] [-z] [-f script]\n", name);
+}
+
+int main(int argc, char **argv) {
     bool run = true;
+    bool parse_failed = false;
+    const char *script = NULL;
+    bool zygote = false;
+    // parse command lines without running them
+    bool parse_only = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "f:nz")) != -1) {
+        switch (opt) {
+            case 'f':
+                script = optarg;
+                break;
+            case 'n':
+                parse_only = true;
+                break;
+            case 'z':
+                zygote = true;
+                break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+
+    // zygote is forked before the shell grows, it stays small
+    if (zygote)
+        zygote_start();
+
+    // scripts are run without job control
+    jobs_init(!script);
+    trace_init();
+
+    if (script)
+        return run_script(script, parse_only);
 
     while (run) {
+        // report background jobs finished since the last command
+        jobs_notify();
+
         unsigned int cmdline_size;
         char *cmdline = read_cmdline(stdin, &cmdline_size);
-        char **tokens = NULL;
-        struct shell_job *jobs = NULL;
+        struct parsed_line *line = NULL;
 
         if (!cmdline) {
             run = false;
             continue;
         }
 
-        int num_tokens;
-        tokens = cmdline_tokens(cmdline, cmdline_size, &num_tokens);
-        
-        if (!tokens) {
-            printf("Parsing error occured!\n");
-            goto loop_out;
-        }
-
-        if (!num_tokens) goto loop_out;
-
-        int num_jobs;
-        jobs = retrieve_jobs(tokens, num_tokens, &num_jobs);
+        trace_line_reset();
+        trace_parse_begin();
+        enum parse_status status = parse_line(cmdline, cmdline_size, parse_only, &line);
+        trace_parse_end();
 
-        if (!jobs) {
-            printf("Error occured while parsing jobs\n");
-            goto loop_out;
+        if (status == PARSE_OK && !parse_only) {
+            chain_jobs(line->jobs, line->num_jobs);
+        } else if (status != PARSE_OK && status != PARSE_EMPTY) {
+            printf("%s\n", parse_strerror(status));
+            parse_failed = true;
         }
 
-        if (chain_jobs(jobs, num_jobs)) goto loop_out;
-
-        loop_out:
-
-        free_jobs(jobs, num_jobs);
-        free_tokens(tokens, num_tokens);        
+        parsed_line_put(line);
         free(cmdline);
     }
-}
\ No newline at end of file
+
+    return parse_only && parse_failed ? 2 : 0;
+}
@@ -0,0 +1,248 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#include "parallel.h"
+#include "runner.h"
+#include "jobs.h"
+#include "trace.h"
+#include "script.h"
+
+// one command line given to parallel
+struct task {
+    const char *cmdline;
+    struct parsed_line *line;
+    struct job *job;
+};
+
+static int parse_jobs_limit(const char *value, int *limit) {
+    char *end;
+    long n = strtol(value, &end, 10);
+    if (!*value || *end || n <= 0 || n > 65536) {
+        fprintf(stderr, "parallel: %s: invalid number of jobs\n", value);
+        return -1;
+    }
+    *limit = (int) n;
+    return 0;
+}
+
+// reads all of @in, lines of it are the command lines
+static char *read_all(int in, size_t *size) {
+    size_t capacity = 1 << 12;
+    char *data = malloc(capacity);
+    *size = 0;
+
+    while (true) {
+        if (*size + 1 == capacity) {
+            capacity *= 2;
+            data = realloc(data, capacity);
+        }
+
+        ssize_t n = read(in, data + *size, capacity - *size - 1);
+        if (n == 0)
+            break;
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "parallel: read error: %s\n", strerror(errno));
+            free(data);
+            return NULL;
+        }
+        *size += n;
+    }
+
+    data[*size] = '\0';
+    return data;
+}
+
+static char **split_lines(char *data, int *num_lines) {
+    char **lines = NULL;
+    *num_lines = 0;
+
+    for (char *p = data; *p; ) {
+        char *end = strchr(p, '\n');
+        if (end)
+            *end = '\0';
+
+        lines = realloc(lines, sizeof(char *) * (++*num_lines));
+        lines[*num_lines - 1] = p;
+
+        if (!end)
+            break;
+        p = end + 1;
+    }
+
+    return lines;
+}
+
+// starts the task with the shell's own launcher, without waiting
+static struct job *start_task(struct task *t) {
+    struct shell_job *jobs = t->line->jobs;
+    int num_jobs = t->line->num_jobs;
+
+    if (num_jobs == 1 && jobs[0].operator != OP_BG) {
+        int status;
+        struct job *j = spawn_job(&jobs[0], SPAWN_ASYNC, &status);
+        if (!j) {
+            // nothing was forked, builtin ran in place or failed
+            j = job_new(t->cmdline, false);
+            job_add_done(j, "parallel", W_EXITCODE(status & 0xff, 0));
+        }
+        return j;
+    }
+
+    return spawn_subshell(jobs, num_jobs, SPAWN_ASYNC);
+}
+
+static void report_task(int idx, struct task *t) {
+    int code = job_exit_code(job_status(t->job));
+    fprintf(stderr, "parallel: [%d] exit %d %.3fs: %s\n",
+            idx + 1, code, job_real_us(t->job) / 1e6, t->cmdline);
+}
+
+int builtin_parallel(char **argv, int argc, int in, int out) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int limit = cpus > 0 ? (int) cpus : 1;
+
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; ++i) {
+        if (!strcmp(argv[i], "--")) {
+            ++i;
+            break;
+        }
+
+        if (strncmp(argv[i], "-j", 2)) {
+            fprintf(stderr, "parallel: %s: invalid option\n", argv[i]);
+            fprintf(stderr, "parallel: usage: parallel [-j N] [cmdline]...\n");
+            return 2;
+        }
+
+        const char *value = argv[i][2] ? argv[i] + 2 : argv[++i];
+        if (!value) {
+            fprintf(stderr, "parallel: -j: option requires an argument\n");
+            return 2;
+        }
+        if (parse_jobs_limit(value, &limit))
+            return 2;
+    }
+
+    // command lines are the arguments, or the lines of stdin
+    char *data = NULL;
+    char **cmdlines;
+    int num_cmdlines;
+    if (i < argc) {
+        cmdlines = argv + i;
+        num_cmdlines = argc - i;
+    } else {
+        size_t size;
+        data = read_all(in, &size);
+        if (!data)
+            return 1;
+        cmdlines = split_lines(data, &num_cmdlines);
+    }
+
+    // children get their output and input through fds 1 and 0;
+    // stdin was consumed above, so commands must not read it
+    fflush(stdout);
+    int saved_in = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 10);
+    int saved_out = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+    if (out != STDOUT_FILENO)
+        dup2(out, STDOUT_FILENO);
+    if (data) {
+        int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        dup2(null_fd, STDIN_FILENO);
+        close(null_fd);
+    }
+
+    struct task *tasks = calloc(num_cmdlines ? num_cmdlines : 1, sizeof(struct task));
+    // running jobs, slot is NULL when it is free
+    struct job **running = calloc(limit, sizeof(struct job *));
+    int *running_idx = calloc(limit, sizeof(int));
+    int num_running = 0;
+
+    int num_tasks = 0, num_failed = 0;
+    double total_us = 0;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int k = 0; k < num_cmdlines || num_running; ) {
+        // fill free slots, then wait for any job to finish
+        if (k < num_cmdlines && num_running < limit) {
+            struct task *t = &tasks[k];
+            t->cmdline = cmdlines[k++];
+
+            enum parse_status status = parse_line(t->cmdline, strlen(t->cmdline),
+                                                  true, &t->line);
+            if (status == PARSE_EMPTY)
+                continue;
+
+            if (status != PARSE_OK) {
+                fprintf(stderr, "parallel: [%d] %s: %s\n",
+                        k, parse_strerror(status), t->cmdline);
+                ++num_tasks;
+                ++num_failed;
+                continue;
+            }
+
+            ++num_tasks;
+            t->job = start_task(t);
+            if (!t->job) {
+                ++num_failed;
+                parsed_line_put(t->line);
+                t->line = NULL;
+                continue;
+            }
+
+            int slot = 0;
+            while (running[slot])
+                ++slot;
+            running[slot] = t->job;
+            running_idx[slot] = k - 1;
+            ++num_running;
+            continue;
+        }
+
+        int slot = jobs_wait_any(running, limit);
+        if (slot == -1)
+            break;
+
+        struct task *t = &tasks[running_idx[slot]];
+        running[slot] = NULL;
+        --num_running;
+
+        report_task(running_idx[slot], t);
+        if (job_status(t->job))
+            ++num_failed;
+        total_us += job_real_us(t->job);
+
+        job_finish(t->job);
+        t->job = NULL;
+        parsed_line_put(t->line);
+        t->line = NULL;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    fprintf(stderr, "parallel: %d commands, %d failed, wall %.3fs, total %.3fs\n",
+            num_tasks, num_failed, timespec_us(&start, &end) / 1e6, total_us / 1e6);
+
+    dup2(saved_in, STDIN_FILENO);
+    dup2(saved_out, STDOUT_FILENO);
+    close(saved_in);
+    close(saved_out);
+
+    free(running);
+    free(running_idx);
+    free(tasks);
+    if (data) {
+        free(cmdlines);
+        free(data);
+    }
+
+    return num_failed ? 1 : 0;
+}
@@ -0,0 +1,13 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+/*
+ * parallel [-j N] [cmdline]... runs command lines given as
+ * arguments or read from stdin, at most N at a time (number of
+ * online CPUs by default). Every command is started with the
+ * shell's own launcher; its status and time are reported when it
+ * finishes, and a summary is printed at the end.
+ */
+int builtin_parallel(char **argv, int argc, int in, int out);
+
+#endif /* PARALLEL_H */
@@ -16,6 +16,7 @@
 #define S7 7
 #define S8 8
 #define S9 9
+#define S10 10
 
 // define final states for FSA
 #define S_FLUSH 100 /* Flush */
@@ -30,6 +31,7 @@
 #define T_ARR 4 /* > */
 #define T_SQUOTE 5 /* ' */
 #define T_DQUOTE 6 /* " */
+#define T_IN 7 /* < */
 
 
 char *read_cmdline(FILE *instream, unsigned int *size) {
@@ -72,36 +74,47 @@ char *read_cmdline(FILE *instream, unsigned int *size) {
     }
 }
 
-int fsa[][7] = {
+int fsa[][8] = {
     [S0] = {[T_LET] = S1, [T_DEL] = S_DROP, [T_AND] = S2, [T_OR] = S4,
-            [T_ARR] = S6, [T_SQUOTE] = S8, [T_DQUOTE] = S9},
+            [T_ARR] = S6, [T_SQUOTE] = S8, [T_DQUOTE] = S9, [T_IN] = S10},
 
     [S1] = {[T_LET] = S1, [T_DEL] = S_FLUSH, [T_AND] = S_FLUSH, [T_OR] = S_FLUSH,
-            [T_ARR] = S_FLUSH, [T_SQUOTE] = S_FLUSH, [T_DQUOTE] = S_FLUSH},
+            [T_ARR] = S_FLUSH, [T_SQUOTE] = S_FLUSH, [T_DQUOTE] = S_FLUSH,
+            [T_IN] = S_FLUSH},
 
     [S2] = {[T_LET] = S_FLUSH, [T_DEL] = S_FLUSH, [T_AND] = S3, [T_OR] = S_ERR,
-            [T_ARR] = S_ERR, [T_SQUOTE] = S_FLUSH, [T_DQUOTE] = S_FLUSH},
+            [T_ARR] = S_ERR, [T_SQUOTE] = S_FLUSH, [T_DQUOTE] = S_FLUSH,
+            [T_IN] = S_ERR},
 
     [S3] = {[T_LET] = S_FLUSH, [T_DEL] = S_FLUSH, [T_AND] = S_ERR, [T_OR] = S_ERR,
-            [T_ARR] = S_ERR, [T_SQUOTE] = S_FLUSH, [T_DQUOTE] = S_FLUSH},
+            [T_ARR] = S_ERR, [T_SQUOTE] = S_FLUSH, [T_DQUOTE] = S_FLUSH,
+            [T_IN] = S_ERR},
 
     [S4] = {[T_LET] = S_FLUSH, [T_DEL] = S_FLUSH, [T_AND] = S_ERR, [T_OR] = S5,
-            [T_ARR] = S_ERR, [T_SQUOTE] = S_FLUSH, [T_DQUOTE] = S_FLUSH},
+            [T_ARR] = S_ERR, [T_SQUOTE] = S_FLUSH, [T_DQUOTE] = S_FLUSH,
+            [T_IN] = S_ERR},
 
     [S5] = {[T_LET] = S_FLUSH, [T_DEL] = S_FLUSH, [T_AND] = S_ERR, [T_OR] = S_ERR,
-            [T_ARR] = S_ERR, [T_SQUOTE] = S_FLUSH, [T_DQUOTE] = S_FLUSH},
+            [T_ARR] = S_ERR, [T_SQUOTE] = S_FLUSH, [T_DQUOTE] = S_FLUSH,
+            [T_IN] = S_ERR},
             
     [S6] = {[T_LET] = S_FLUSH, [T_DEL] = S_FLUSH, [T_AND] = S_ERR, [T_OR] = S_ERR,
-            [T_ARR] = S7, [T_SQUOTE] = S_FLUSH, [T_DQUOTE] = S_FLUSH},
+            [T_ARR] = S7, [T_SQUOTE] = S_FLUSH, [T_DQUOTE] = S_FLUSH,
+            [T_IN] = S_ERR},
 
     [S7] = {[T_LET] = S_FLUSH, [T_DEL] = S_FLUSH, [T_AND] = S_ERR, [T_OR] = S_ERR,
-            [T_ARR] = S_ERR, [T_SQUOTE] = S_FLUSH, [T_DQUOTE] = S_FLUSH},
+            [T_ARR] = S_ERR, [T_SQUOTE] = S_FLUSH, [T_DQUOTE] = S_FLUSH,
+            [T_IN] = S_ERR},
 
     [S8] = {[T_LET] = S8, [T_DEL] = S8, [T_AND] = S8, [T_OR] = S8,
-            [T_ARR] = S8, [T_SQUOTE] = S_FLUSH, [T_DQUOTE] = S8},
+            [T_ARR] = S8, [T_SQUOTE] = S_FLUSH, [T_DQUOTE] = S8, [T_IN] = S8},
 
     [S9] = {[T_LET] = S9, [T_DEL] = S9, [T_AND] = S9, [T_OR] = S9,
-            [T_ARR] = S9, [T_SQUOTE] = S9, [T_DQUOTE] = S_FLUSH},
+            [T_ARR] = S9, [T_SQUOTE] = S9, [T_DQUOTE] = S_FLUSH, [T_IN] = S9},
+
+    [S10] = {[T_LET] = S_FLUSH, [T_DEL] = S_FLUSH, [T_AND] = S_ERR, [T_OR] = S_ERR,
+             [T_ARR] = S_ERR, [T_SQUOTE] = S_FLUSH, [T_DQUOTE] = S_FLUSH,
+             [T_IN] = S_ERR},
 };
 
 
@@ -176,6 +189,10 @@ char **cmdline_tokens(const char *_cmdline, unsigned int size, int *num_tokens)
             case '>':
                 transition = T_ARR;
                 break;
+
+            case '<':
+                transition = T_IN;
+                break;
             
             case '\\':
                 if (cur_state != S9 || cmdline[i + 1] == '\\')
@@ -281,6 +298,7 @@ void free_jobs(struct shell_job *jobs, int num_jobs) {
             for (int j = 0; j < jobs[i].num_tokens; ++j)
                 free(jobs[i].tokens[j]);
             free(jobs[i].tokens);
+            free_cmds(jobs[i].cmds, jobs[i].num_cmds);
         }
         free(jobs);
     }
@@ -314,6 +332,7 @@ struct cmd *retrieve_cmds(struct shell_job *_job, int *num_cmds) {
 
     char *out_fname = NULL;
     bool out_append = false;
+    char *in_fname = NULL;
 
     for (int i = 0; i < job->num_tokens; ++i) {
         const char *token = job->tokens[i];
@@ -336,8 +355,20 @@ struct cmd *retrieve_cmds(struct shell_job *_job, int *num_cmds) {
             else
                 out_append = false;
 
+        } else if (!strcmp(token, "<")) {
+            if (i == job->num_tokens - 1) {
+                free_cmds(cmds, *num_cmds);
+                *num_cmds = 0;
+                cmds = NULL;
+                goto end;
+            }
+
+            ++i;
+            free(in_fname);
+            in_fname = strdup(job->tokens[i]);
+
         } else if (!strcmp(token, "|")) {
-            if (i == 0) {
+            if (i == 0 || !cmd_len) {
                 free_cmds(cmds, *num_cmds);
                 *num_cmds = 0;
                 cmds = NULL;
@@ -356,6 +387,7 @@ struct cmd *retrieve_cmds(struct shell_job *_job, int *num_cmds) {
                 .argc = cmd_len,
                 .output_fname = _out_fname,
                 .output_append = out_append,
+                .input_fname = in_fname,
             };
 
             cmd_len = 0;
@@ -363,10 +395,13 @@ struct cmd *retrieve_cmds(struct shell_job *_job, int *num_cmds) {
             free(out_fname);
             out_fname = NULL;
             out_append = false;
+            in_fname = NULL;
 
         } else {
-            cur_cmd = realloc(cur_cmd, sizeof(char *) * (++cmd_len));
+            // args are kept null-terminated for exec
+            cur_cmd = realloc(cur_cmd, sizeof(char *) * (++cmd_len + 1));
             cur_cmd[cmd_len - 1] = strdup(token);
+            cur_cmd[cmd_len] = NULL;
         }
     }
 
@@ -376,6 +411,7 @@ end:
     free(cur_cmd);
 
     free(out_fname);
+    free(in_fname);
     
     free_jobs(job, 1);
     return cmds;
@@ -394,6 +430,15 @@ void free_cmds(struct cmd *cmds, int num_cmds) {
 
         if (cmds[i].output_fname)
             free(cmds[i].output_fname);
+        free(cmds[i].input_fname);
     }
     free(cmds);
-}
\ No newline at end of file
+}
+
+struct cmd *job_cmds(struct shell_job *job, int *num_cmds) {
+    if (!job->cmds)
+        job->cmds = retrieve_cmds(job, &job->num_cmds);
+
+    *num_cmds = job->num_cmds;
+    return job->cmds;
+}
@@ -36,6 +36,8 @@ struct cmd {
 
     char *output_fname;
     bool output_append;
+
+    char *input_fname;
 };
 
 enum job_operator {
@@ -48,6 +50,10 @@ struct shell_job {
     char **tokens;
     int num_tokens;
     enum job_operator operator;
+
+    // commands of the job, built on the first run
+    struct cmd *cmds;
+    int num_cmds;
 };
 
 char *read_cmdline(FILE *instream, unsigned int *size);
@@ -64,4 +70,6 @@ struct cmd *retrieve_cmds(struct shell_job *job, int *num_cmds);
 
 void free_cmds(struct cmd *cmds, int num_cmds);
 
+struct cmd *job_cmds(struct shell_job *job, int *num_cmds);
+
 #endif /* PARSER_H */
\ No newline at end of file
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/types.h>
@@ -7,228 +8,446 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 
 #include "parser.h"
 #include "runner.h"
+#include "cmdhash.h"
+#include "jobs.h"
+#include "builtins.h"
+#include "trace.h"
+#include "zygote.h"
+#include "ufsredir.h"
+
+struct shell_options shell_opts = {
+    .pipe_size = 0,
+};
+
+static const char *operator_str(enum job_operator operator) {
+    switch (operator) {
+        case OP_AND: return "&&";
+        case OP_OR: return "||";
+        default: return "&";
+    }
+}
+
+// text of the jobs for job table listings
+static char *job_cmdline(struct shell_job *jobs, int num_jobs) {
+    size_t len = 0;
+    char *cmdline = malloc(1);
+    cmdline[0] = '\0';
+
+    for (int k = 0; k < num_jobs; ++k) {
+        for (int i = 0; i <= jobs[k].num_tokens; ++i) {
+            const char *word;
+            if (i < jobs[k].num_tokens)
+                word = jobs[k].tokens[i];
+            else if (k < num_jobs - 1)
+                word = operator_str(jobs[k].operator);
+            else
+                break;
+
+            size_t word_len = strlen(word);
+            cmdline = realloc(cmdline, len + word_len + 2);
+            if (len)
+                cmdline[len++] = ' ';
+            memcpy(cmdline + len, word, word_len + 1);
+            len += word_len;
+        }
+    }
+
+    return cmdline;
+}
 
-int chain_jobs(struct shell_job *_jobs, int _num_jobs) {
+static int run_chain(struct shell_job *jobs, int num_jobs) {
+    int status = 0;
 
-    int num_jobs = 0;
-    struct shell_job *jobs = NULL;
+    for (int i = 0; i < num_jobs; ++i) {
+        // operator of the previous job decides if this one runs
+        if (i > 0) {
+            enum job_operator operator = jobs[i - 1].operator;
+            if ((operator == OP_AND && status) || (operator == OP_OR && !status))
+                continue;
+        }
 
-    for (int k = 0; k < _num_jobs; ++k) {
-        jobs = realloc(jobs, sizeof(struct shell_job) * (++num_jobs));
-        
-        char **job_tokens = malloc(sizeof(char *) * _jobs[k].num_tokens);
-        for (int j = 0; j < _jobs[k].num_tokens; ++j)
-            job_tokens[j] = strdup(_jobs[k].tokens[j]);
+        status = run_job(&jobs[i]);
+    }
 
-        jobs[num_jobs - 1] = (struct shell_job) {
-            .tokens = job_tokens,
-            .num_tokens = _jobs[k].num_tokens,
-            .operator = _jobs[k].operator,
-        };
+    return status;
+}
 
-        if (jobs[k].operator == OP_BG) {
+struct job *spawn_subshell(struct shell_job *jobs, int num_jobs, int flags) {
+    char *cmdline = job_cmdline(jobs, num_jobs);
+    struct job *j = job_new(cmdline, flags & SPAWN_OWN_GROUP);
+    free(cmdline);
 
-            int pid = fork();
+    fflush(stdout);
 
-            if (!pid) {
-                setsid(); // make bg proces group leader (to avoid zombies)
+    struct timespec fork_start;
+    clock_gettime(CLOCK_MONOTONIC, &fork_start);
 
-                // this buch of jobs is executing in fork
-                for (int i = 0; i < num_jobs; ++i) {
-                    if (run_job(&jobs[i])) {
-                        if (jobs[i].operator != OP_OR) 
-                            exit(1);
-                        else ++i;
-                    } 
-                }
+    int pid = fork();
 
-                exit(0);
-            } else if (pid < 0) {
-                printf("chain_jobs: Failed to fork\n");
-                free_jobs(jobs, num_jobs);
-                return 1;   
-            }
+    if (!pid) {
+        job_child_setup(j, false);
+        ufs_redirect_forked();
+        exit(run_chain(jobs, num_jobs));
+    } else if (pid < 0) {
+        printf("chain_jobs: Failed to fork\n");
+        job_free(j);
+        return NULL;
+    }
+
+    struct job_proc *p = job_add_pid(j, pid, "subshell");
+    p->fork_start = fork_start;
+    clock_gettime(CLOCK_MONOTONIC, &p->fork_end);
+    p->exec_end = p->fork_end;
 
-            // clear jobs bunch
-            free_jobs(jobs, num_jobs);
-            jobs = NULL;
-            num_jobs = 0; 
+    return j;
+}
+
+static int run_bg(struct shell_job *jobs, int num_jobs) {
+    struct job *j = NULL;
+    int flags = SPAWN_ASYNC | SPAWN_OWN_GROUP;
+
+    if (num_jobs == 1) {
+        // single pipeline is started right from the shell
+        int status;
+        j = spawn_job(&jobs[0], flags, &status);
+        if (!j)
+            return status;
+    } else {
+        // chain needs a shell to decide what to run next
+        j = spawn_subshell(jobs, num_jobs, flags);
+        if (!j)
+            return 1;
+    }
+
+    int id = job_register(j);
+    if (jobs_interactive())
+        fprintf(stderr, "[%d] %d\n", id, j->pgid);
+
+    return 0;
+}
+
+int chain_jobs(struct shell_job *jobs, int num_jobs) {
+    int status = 0;
+    int start = 0;
+
+    // every & ends a group of jobs which runs in background
+    for (int k = 0; k < num_jobs; ++k) {
+        if (jobs[k].operator != OP_BG)
+            continue;
+
+        run_bg(jobs + start, k - start + 1);
+        start = k + 1;
+    }
+
+    if (start < num_jobs)
+        status = run_chain(jobs + start, num_jobs - start);
+
+    return status;
+}
+
+// opens output file of the command, returns -1 on failure
+static int open_redirect(struct cmd *cmd) {
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+    if (cmd->output_append)
+        flags |= O_APPEND;
+    else
+        flags |= O_TRUNC;
+    
+    // mode: rw.-rw.-r..
+    int mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH;
+
+    int outfd = open(cmd->output_fname, flags, mode);
+    if (outfd == -1)
+        perror("redirect to file");
+
+    return outfd;
+}
+
+// redirects are opened by the shell, so the same fds work for a
+// builtin, a forked child and the zygote; @in and @out are -1 if
+// there is no redirect, returns -1 on failure
+static int open_redirects(struct job *j, struct cmd *cmd, int *in, int *out) {
+    *in = -1;
+    *out = -1;
+
+    if (cmd->input_fname) {
+        if (is_ufs_path(cmd->input_fname)) {
+            *in = ufs_redirect_input(cmd->input_fname);
+        } else {
+            *in = open(cmd->input_fname, O_RDONLY | O_CLOEXEC);
+            if (*in == -1)
+                perror("redirect from file");
         }
+
+        if (*in == -1)
+            return -1;
     }
 
-    if (jobs) {
-        for (int i = 0; i < num_jobs; ++i) {
-            if (run_job(&jobs[i])) {
-                if (jobs[i].operator == OP_AND) {
-                    free_jobs(jobs, num_jobs);
-                    return 1;
-                }
-            } else if (jobs[i].operator == OP_OR) ++i; 
+    if (cmd->output_fname) {
+        if (is_ufs_path(cmd->output_fname))
+            *out = ufs_redirect_output(j, cmd->output_fname, cmd->output_append);
+        else
+            *out = open_redirect(cmd);
+
+        if (*out == -1) {
+            if (*in != -1)
+                close(*in);
+            *in = -1;
+            return -1;
         }
     }
 
-    free_jobs(jobs, num_jobs);
     return 0;
 }
 
-int run_job(struct shell_job *job) {
-    
-    int ret_value = 0;
-    int (*fds)[2] = NULL;
-    int *pids;
+// builtin is run by the shell itself if it is the last stage of
+// a foreground pipeline: all the stages before it are already
+// started, so it can not block on a pipe nobody reads
+static bool run_in_shell(const struct builtin *b, int flags, int stage, int num_cmds, int in) {
+    if (!b || (flags & SPAWN_ASYNC) || stage != num_cmds - 1)
+        return false;
+
+    if (b->flags & BUILTIN_SPECIAL)
+        return num_cmds == 1;
+
+    // the terminal is handed to the job, not to the shell
+    if ((b->flags & BUILTIN_READS_INPUT) && jobs_interactive() && isatty(in))
+        return false;
+
+    return b->flags & BUILTIN_FAST;
+}
+
+struct job *spawn_job(struct shell_job *job, int flags, int *status) {
+    *status = 0;
+
+    int num_cmds = 0;
+    trace_parse_begin();
+    struct cmd *cmds = job_cmds(job, &num_cmds);
+    trace_parse_end();
 
-    int num_cmds;
-    struct cmd *cmds = retrieve_cmds(job, &num_cmds);
     if (!cmds) {
         printf("Failed to retrieve cmds\n");
-        ret_value = 1;
-        goto end;
+        *status = 1;
+        return NULL;
     }
-    
-    // handle explicitly if last command of pipe is exit
-    if (num_cmds == 1 && !strcmp(cmds[0].name, "exit"))
-        builtin_exit(cmds[0].args, cmds[0].argc);
 
-    pids = malloc(sizeof(int) * num_cmds);
-    fds = malloc(sizeof(int[2]) * num_cmds);
+    char *cmdline = job_cmdline(job, 1);
+    struct job *j = job_new(cmdline, flags & SPAWN_OWN_GROUP);
+    j->parse_us = trace_parse_us();
+    free(cmdline);
 
-    for (int i = 0; i < num_cmds; ++i) {
-        if (pipe(fds[i])) {
-            printf("Failed to initialize pipe\n");
-            ret_value = 1;
-            goto end;
-        }
-    }
+    // time prefix is not a command, it marks the whole pipeline;
+    // commands are cached with the job, so it is skipped, not removed
+    if (!strcmp(cmds[0].name, "time") && cmds[0].argc > 1)
+        j->timed = true;
+
+    // read end of the pipe from the previous stage
+    int prev_read = -1;
 
+    // pipes are created stage by stage, so each process sees
+    // only pipes to its neighbours, the rest are closed on exec
     for (int i = 0; i < num_cmds; ++i) {
-        // terminate args with null-pointer by convention
-        cmds[i].args = realloc(cmds[i].args, sizeof(char *) * (++cmds[i].argc));
-        cmds[i].args[cmds[i].argc - 1] = NULL;
+        int out_pipe[2] = {-1, -1};
+        int redirect_in = -1, redirect_out = -1;
+
+        if (i < num_cmds - 1) {
+            if (pipe2(out_pipe, O_CLOEXEC)) {
+                printf("Failed to initialize pipe\n");
+                *status = 1;
+                break;
+            }
 
-        // process builtins
-        if (!strcmp(cmds[i].name, "cd")) {
-            builtin_cd(cmds[i].args, cmds[i].argc);
-            continue;
+            if (shell_opts.pipe_size > 0
+                && fcntl(out_pipe[1], F_SETPIPE_SZ, shell_opts.pipe_size) == -1)
+                perror("set pipe size");
         }
 
-        int pid = fork();
+        int skip = i == 0 && j->timed ? 1 : 0;
+        char **argv = cmds[i].args + skip;
+        int argc = cmds[i].argc - skip;
 
-        if (!pid) {
-            // child
-            
-            // MUST close not used pipes here
-            for (int j = 0; j < num_cmds; ++j) {
-                if (j != i - 1)
-                    close(fds[j][0]);
-                if (j != i)
-                    close(fds[j][1]);
-            }
+        const struct builtin *b = find_builtin(argv, argc);
 
-            if (!strcmp(cmds[i].name, "exit")) {
-                if (i > 0)
-                    close(fds[i - 1][0]);
-                close(fds[i][1]);
-                builtin_exit(cmds[i].args, cmds[i].argc);
-            }
+        if (open_redirects(j, &cmds[i], &redirect_in, &redirect_out)) {
+            job_add_done(j, argv[0], W_EXITCODE(1, 0));
+            goto next_stage;
+        }
 
-            if (i > 0) {    
-                if (dup2(fds[i - 1][0], STDIN_FILENO) == -1) {
-                    perror("dup2 stdin");
-                    exit(1);
-                }
-            }
+        // redirects take over the pipes
+        int in = redirect_in != -1 ? redirect_in
+            : prev_read != -1 ? prev_read : STDIN_FILENO;
+        int out = redirect_out != -1 ? redirect_out
+            : out_pipe[1] != -1 ? out_pipe[1] : STDOUT_FILENO;
+
+        if (run_in_shell(b, flags, i, num_cmds, in)) {
+            struct timespec start, end;
+            struct rusage ru_start, ru_end;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            getrusage(RUSAGE_SELF, &ru_start);
+
+            fflush(stdout);
+            int code = b->func(argv, argc, in, out);
+
+            getrusage(RUSAGE_SELF, &ru_end);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+
+            struct job_proc *p = job_add_done(j, argv[0], W_EXITCODE(code & 0xff, 0));
+            p->fork_start = p->fork_end = p->exec_end = start;
+            p->finished = end;
+            timersub(&ru_end.ru_utime, &ru_start.ru_utime, &p->rusage.ru_utime);
+            timersub(&ru_end.ru_stime, &ru_start.ru_stime, &p->rusage.ru_stime);
+            goto next_stage;
+        }
 
-            if (cmds[i].output_fname) {
-                close(fds[i][1]);
+        // resolve in parent, so the result stays in the cache
+        const char *exec_path = b ? NULL : cmdhash_lookup(argv[0]);
+
+        // builtins need the shell's memory, only commands can be
+        // started by the zygote
+        bool use_zygote = !b && zygote_enabled();
+
+        // in trace mode child's copy of this pipe is closed by a
+        // successful exec, which tells the parent exec latency
+        int exec_pipe[2] = {-1, -1};
+        if (trace_enabled() && !b && pipe2(exec_pipe, O_CLOEXEC))
+            perror("trace exec pipe");
+
+        // do not let children inherit unflushed output
+        fflush(stdout);
+
+        struct timespec fork_start;
+        clock_gettime(CLOCK_MONOTONIC, &fork_start);
+
+        int pid = -1;
+        if (use_zygote) {
+            struct zygote_cmd zc = {
+                .path = exec_path,
+                .argv = argv,
+                .argc = argc,
+                .pgid = j->own_group ? j->pgid : -1,
+                .tty = j->own_group && !(flags & SPAWN_ASYNC) && jobs_interactive(),
+                .fds = {in, out, STDERR_FILENO},
+                .exec_fd = exec_pipe[1],
+            };
+            pid = zygote_spawn(&zc);
+        }
 
-                int flags = O_WRONLY | O_CREAT;
-                if (cmds[i].output_append)
-                    flags |= O_APPEND;
-                else
-                    flags |= O_TRUNC;
-                
-                // mode: rw.-rw.-r..
-                int mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH;
+        // without the zygote, or if it failed, shell forks itself
+        if (pid == -1)
+            pid = fork();
 
-                int outfd = open(cmds[i].output_fname, flags, mode);
+        if (!pid) {
+            // child
+            job_child_setup(j, !(flags & SPAWN_ASYNC));
 
-                if (outfd == -1) {
-                    perror("redirect to file");
+            if (in != STDIN_FILENO) {
+                if (dup2(in, STDIN_FILENO) == -1) {
+                    perror("dup2 stdin");
                     exit(1);
                 }
+            }
 
-                if (dup2(outfd, STDOUT_FILENO) == -1) {
-                    perror("dup2 file redirect");
-                    exit(1);
-                }
-            } else if (i < num_cmds - 1) {
-                if (dup2(fds[i][1], STDOUT_FILENO) == -1) {
+            if (out != STDOUT_FILENO) {
+                if (dup2(out, STDOUT_FILENO) == -1) {
                     perror("dup2 stdout");
                     exit(1);
                 }
             }
-            execvp(cmds[i].name, cmds[i].args);
+
+            // builtins inside of pipelines run in a subshell,
+            // which still saves an exec
+            if (b) {
+                ufs_redirect_forked();
+                exit(b->func(argv, argc, STDIN_FILENO, STDOUT_FILENO));
+            }
+
+            // cached path might be stale, then search PATH again
+            if (exec_path)
+                execv(exec_path, argv);
+            execvp(argv[0], argv);
 
             // execvp failed
             exit(1);
         } else if (pid > 0) {
             // parent
-            pids[i] = pid;
+            struct job_proc *p = job_add_pid(j, pid, argv[0]);
+            p->fork_start = fork_start;
+            clock_gettime(CLOCK_MONOTONIC, &p->fork_end);
+            p->exec_end = p->fork_end;
+
+            if (exec_pipe[0] != -1) {
+                char c;
+                close(exec_pipe[1]);
+                while (read(exec_pipe[0], &c, 1) == -1 && errno == EINTR);
+                close(exec_pipe[0]);
+                clock_gettime(CLOCK_MONOTONIC, &p->exec_end);
+            }
         } else {
             // error
             printf("Failed to fork\n");
-            ret_value = 1;
-            goto end;
+            *status = 1;
+            if (exec_pipe[0] != -1) {
+                close(exec_pipe[0]);
+                close(exec_pipe[1]);
+            }
+            if (out_pipe[0] != -1) {
+                close(out_pipe[0]);
+                close(out_pipe[1]);
+            }
+            if (redirect_in != -1)
+                close(redirect_in);
+            if (redirect_out != -1)
+                close(redirect_out);
+            break;
         }
+
+    next_stage:
+        if (redirect_in != -1)
+            close(redirect_in);
+        if (redirect_out != -1)
+            close(redirect_out);
+        if (prev_read != -1)
+            close(prev_read);
+        if (out_pipe[1] != -1)
+            close(out_pipe[1]);
+        prev_read = out_pipe[0];
     }
 
-    for (int i = 0; i < num_cmds; ++i) {
-        int status;
-        int pid = wait(&status);
-        if (status && !ret_value)
-            ret_value = status;
-        
-        int term_id = -1;
-        for (int j = 0; j < num_cmds; ++j)
-            if (pid == pids[j])
-                term_id = j;
-        
-        if (term_id == num_cmds - 1)
-            ret_value = status;
-
-        if (term_id == -1) continue;
-
-        close(fds[term_id][1]);
-        close(fds[term_id][0]);
-
-        pids[term_id] = -1;
-
-        for (int j = term_id - 1; j >= 0; --j) {
-            if (pids[j] == -1) continue;
-
-            close(fds[j][1]);
-            close(fds[j][0]);
-            pids[j] = -1;
-        }
+    if (prev_read != -1)
+        close(prev_read);
 
+    if (!j->num_procs) {
+        job_free(j);
+        return NULL;
     }
 
-end:
-    for (int i = 0; i < num_cmds; ++i) {
-        close(fds[i][0]);
-        close(fds[i][1]);
-    }
+    return j;
+}
+
+int run_job(struct shell_job *job) {
+    int status;
+    int flags = jobs_interactive() ? SPAWN_OWN_GROUP : 0;
+    struct job *j = spawn_job(job, flags, &status);
+    if (!j)
+        return status;
+
+    status = job_exit_code(job_wait(j, true));
 
-    free(fds);
-    free(pids);
-    free_cmds(cmds, num_cmds);
-    return ret_value;    
+    // stopped job is kept in the job table
+    if (!j->num_alive)
+        job_finish(j);
+
+    return status;
 }
 
-int builtin_cd(char **argv, int argc) {
+int builtin_cd(char **argv, int argc, int in, int out) {
     if (argc < 2)
         return 1;
     
@@ -236,7 +455,7 @@ int builtin_cd(char **argv, int argc) {
     return 0;   
 }
 
-int builtin_exit(char **argv, int argc) {
+int builtin_exit(char **argv, int argc, int in, int out) {
     if (argc < 2)
         exit(0);
 
@@ -245,4 +464,53 @@ int builtin_exit(char **argv, int argc) {
     exit(ret_code);
     
     return 0;
-}
\ No newline at end of file
+}
+
+int builtin_hash(char **argv, int argc, int in, int out) {
+    if (argc < 2) {
+        cmdhash_print(out);
+        return 0;
+    }
+
+    int ret_code = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-r"))
+            cmdhash_reset();
+        else if (!strcmp(argv[i], "-m"))
+            cmdhash_set_check_mtime(true);
+        else if (!strcmp(argv[i], "+m"))
+            cmdhash_set_check_mtime(false);
+        else if (!cmdhash_add(argv[i])) {
+            fprintf(stderr, "hash: %s: not found\n", argv[i]);
+            ret_code = 1;
+        }
+    }
+
+    return ret_code;
+}
+
+int builtin_set(char **argv, int argc, int in, int out) {
+    if (argc < 2) {
+        dprintf(out, "pipesz\t%d\n", shell_opts.pipe_size);
+        return 0;
+    }
+
+    if (argc != 3) {
+        fprintf(stderr, "set: usage: set [NAME VALUE]\n");
+        return 1;
+    }
+
+    if (!strcmp(argv[1], "pipesz")) {
+        // 0 keeps the default pipe capacity
+        int size;
+        if (sscanf(argv[2], "%d", &size) != 1 || size < 0) {
+            fprintf(stderr, "set: invalid pipe size: %s\n", argv[2]);
+            return 1;
+        }
+        shell_opts.pipe_size = size;
+        return 0;
+    }
+
+    fprintf(stderr, "set: unknown option: %s\n", argv[1]);
+    return 1;
+}
@@ -2,13 +2,37 @@
 #define RUNNER_H
 
 #include "parser.h"
+#include "jobs.h"
+
+struct shell_options {
+    // capacity of pipeline pipes in bytes, 0 for system default
+    int pipe_size;
+};
+
+extern struct shell_options shell_opts;
+
+enum spawn_flags {
+    // nobody waits for the job right away: every stage runs in
+    // a child and the job does not take the terminal
+    SPAWN_ASYNC = 1,
+    // job gets its own process group
+    SPAWN_OWN_GROUP = 2,
+};
 
 int chain_jobs(struct shell_job *jobs, int num_jobs);
 
 int run_job(struct shell_job *job);
 
-int builtin_cd(char **argv, int argc);
+struct job *spawn_job(struct shell_job *job, int flags, int *status);
+
+struct job *spawn_subshell(struct shell_job *jobs, int num_jobs, int flags);
+
+int builtin_cd(char **argv, int argc, int in, int out);
+
+int builtin_exit(char **argv, int argc, int in, int out);
+
+int builtin_hash(char **argv, int argc, int in, int out);
 
-int builtin_exit(char **argv, int argc);
+int builtin_set(char **argv, int argc, int in, int out);
 
 #endif /* RUNNER_H */
\ No newline at end of file
@@ -0,0 +1,214 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "script.h"
+#include "parser.h"
+#include "runner.h"
+#include "jobs.h"
+#include "trace.h"
+
+#define PARSE_CACHE_BUCKETS 1024
+// lines beyond this are parsed every time
+#define PARSE_CACHE_MAX 4096
+
+static struct parsed_line *cache[PARSE_CACHE_BUCKETS];
+static int cache_size = 0;
+
+
+static unsigned int hash_line(const char *text) {
+    // FNV-1a
+    unsigned int h = 2166136261u;
+    for (; *text; ++text) {
+        h ^= (unsigned char) *text;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void free_parsed_line(struct parsed_line *line) {
+    free_jobs(line->jobs, line->num_jobs);
+    free(line->text);
+    free(line);
+}
+
+static enum parse_status parse_uncached(const char *cmdline, unsigned int size,
+                                        bool build_cmds, struct parsed_line *line) {
+    int num_tokens;
+    char **tokens = cmdline_tokens(cmdline, size, &num_tokens);
+    if (!tokens)
+        return PARSE_ERR_TOKENS;
+
+    if (!num_tokens) {
+        free_tokens(tokens, num_tokens);
+        return PARSE_EMPTY;
+    }
+
+    line->jobs = retrieve_jobs(tokens, num_tokens, &line->num_jobs);
+    free_tokens(tokens, num_tokens);
+
+    if (!line->jobs)
+        return PARSE_ERR_JOBS;
+
+    if (build_cmds) {
+        for (int i = 0; i < line->num_jobs; ++i) {
+            int num_cmds;
+            if (!job_cmds(&line->jobs[i], &num_cmds))
+                return PARSE_ERR_CMDS;
+        }
+    }
+
+    return PARSE_OK;
+}
+
+enum parse_status parse_line(const char *cmdline, unsigned int size,
+                             bool build_cmds, struct parsed_line **result) {
+    unsigned int hash = hash_line(cmdline);
+    unsigned int bucket = hash % PARSE_CACHE_BUCKETS;
+
+    for (struct parsed_line *line = cache[bucket]; line; line = line->next) {
+        if (line->hash == hash && !strcmp(line->text, cmdline)) {
+            *result = line;
+            return PARSE_OK;
+        }
+    }
+
+    struct parsed_line *line = malloc(sizeof(struct parsed_line));
+    *line = (struct parsed_line) {
+        .text = strdup(cmdline),
+        .hash = hash,
+        .jobs = NULL,
+        .num_jobs = 0,
+        .cached = false,
+        .next = NULL,
+    };
+
+    enum parse_status status = parse_uncached(cmdline, size, build_cmds, line);
+    if (status != PARSE_OK) {
+        free_parsed_line(line);
+        *result = NULL;
+        return status;
+    }
+
+    if (cache_size < PARSE_CACHE_MAX) {
+        line->cached = true;
+        line->next = cache[bucket];
+        cache[bucket] = line;
+        ++cache_size;
+    }
+
+    *result = line;
+    return PARSE_OK;
+}
+
+void parsed_line_put(struct parsed_line *line) {
+    if (line && !line->cached)
+        free_parsed_line(line);
+}
+
+const char *parse_strerror(enum parse_status status) {
+    switch (status) {
+        case PARSE_ERR_TOKENS: return "Parsing error occured!";
+        case PARSE_ERR_JOBS: return "Error occured while parsing jobs";
+        case PARSE_ERR_CMDS: return "Failed to retrieve cmds";
+        default: return "";
+    }
+}
+
+// whole script is loaded to memory, so line numbers can be
+// computed from offsets of the commands
+static char *load_file(const char *path, size_t *size) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return NULL;
+    }
+
+    char *data = NULL;
+    *size = 0;
+    char chunk[1 << 16];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+        data = realloc(data, *size + n + 2);
+        memcpy(data + *size, chunk, n);
+        *size += n;
+    }
+    fclose(f);
+
+    if (!data)
+        data = malloc(2);
+
+    // last line is read only if it is terminated
+    if (!*size || data[*size - 1] != '\n')
+        data[(*size)++] = '\n';
+    data[*size] = '\0';
+
+    return data;
+}
+
+int run_script(const char *path, bool parse_only) {
+    size_t size;
+    char *data = load_file(path, &size);
+    if (!data)
+        return 127;
+
+    FILE *in = fmemopen(data, size, "r");
+
+    struct parsed_line **lines = NULL;
+    int num_lines = 0;
+    int num_errors = 0;
+
+    // parse the whole script before running anything
+    int line_no = 1;
+    long pos = 0;
+    while (true) {
+        unsigned int cmdline_size;
+        char *cmdline = read_cmdline(in, &cmdline_size);
+        if (!cmdline)
+            break;
+
+        long next_pos = ftell(in);
+        int start_line = line_no;
+        for (long i = pos; i < next_pos; ++i)
+            if (data[i] == '\n')
+                ++line_no;
+        pos = next_pos;
+
+        struct parsed_line *line;
+        enum parse_status status = parse_line(cmdline, cmdline_size, true, &line);
+        free(cmdline);
+
+        if (status == PARSE_EMPTY)
+            continue;
+
+        if (status != PARSE_OK) {
+            fprintf(stderr, "%s:%d: %s\n", path, start_line, parse_strerror(status));
+            ++num_errors;
+            continue;
+        }
+
+        lines = realloc(lines, sizeof(struct parsed_line *) * (++num_lines));
+        lines[num_lines - 1] = line;
+    }
+
+    fclose(in);
+    free(data);
+
+    int status = 0;
+    if (num_errors) {
+        status = 2;
+    } else if (!parse_only) {
+        for (int i = 0; i < num_lines; ++i) {
+            jobs_notify();
+            trace_line_reset();
+            status = chain_jobs(lines[i]->jobs, lines[i]->num_jobs);
+        }
+    }
+
+    for (int i = 0; i < num_lines; ++i)
+        parsed_line_put(lines[i]);
+    free(lines);
+
+    return status;
+}
@@ -0,0 +1,41 @@
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+#include <stdbool.h>
+
+#include "parser.h"
+
+/*
+ * Parsed command lines are cached by their text, so a repeated
+ * line skips tokenizing, job splitting and cmd building.
+ */
+struct parsed_line {
+    char *text;
+    unsigned int hash;
+    struct shell_job *jobs;
+    int num_jobs;
+    // line belongs to the cache and must not be freed by caller
+    bool cached;
+    struct parsed_line *next;
+};
+
+enum parse_status {
+    PARSE_OK = 0,
+    // nothing to run: empty line or a comment
+    PARSE_EMPTY,
+    PARSE_ERR_TOKENS,
+    PARSE_ERR_JOBS,
+    PARSE_ERR_CMDS,
+};
+
+enum parse_status parse_line(const char *cmdline, unsigned int size,
+                             bool build_cmds, struct parsed_line **line);
+
+void parsed_line_put(struct parsed_line *line);
+
+const char *parse_strerror(enum parse_status status);
+
+// with @parse_only the script is only checked, nothing is run
+int run_script(const char *path, bool parse_only);
+
+#endif /* SCRIPT_H */
@@ -0,0 +1,163 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "trace.h"
+#include "jobs.h"
+
+static int trace_fd = -1;
+
+static double parse_us = 0;
+static struct timespec parse_start;
+
+
+void trace_init(void) {
+    const char *dest = getenv("SHELL_TRACE");
+    if (!dest || !*dest || !strcmp(dest, "0"))
+        return;
+
+    if (!strcmp(dest, "1") || !strcmp(dest, "stderr")) {
+        trace_fd = STDERR_FILENO;
+        return;
+    }
+
+    trace_fd = open(dest, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (trace_fd == -1)
+        perror("trace");
+}
+
+bool trace_enabled(void) {
+    return trace_fd != -1;
+}
+
+void trace_line_reset(void) {
+    parse_us = 0;
+}
+
+void trace_parse_begin(void) {
+    clock_gettime(CLOCK_MONOTONIC, &parse_start);
+}
+
+void trace_parse_end(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    parse_us += timespec_us(&parse_start, &now);
+}
+
+double trace_parse_us(void) {
+    return parse_us;
+}
+
+double timespec_us(const struct timespec *from, const struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) * 1e6 + (to->tv_nsec - from->tv_nsec) / 1e3;
+}
+
+static double timeval_us(const struct timeval *tv) {
+    return tv->tv_sec * 1e6 + tv->tv_usec;
+}
+
+// prints @str as a JSON string literal
+static void json_string(FILE *out, const char *str) {
+    fputc('"', out);
+    for (; *str; ++str) {
+        unsigned char c = *str;
+        if (c == '"' || c == '\\')
+            fprintf(out, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(out, "\\u%04x", c);
+        else
+            fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+void trace_job(struct job *j) {
+    if (trace_fd == -1)
+        return;
+
+    for (int i = 0; i < j->num_procs; ++i) {
+        struct job_proc *p = &j->procs[i];
+
+        // record is formatted in memory to be written at once
+        char *record = NULL;
+        size_t size = 0;
+        FILE *out = open_memstream(&record, &size);
+
+        fprintf(out, "{\"pipeline\":");
+        json_string(out, j->cmdline);
+        fprintf(out, ",\"stage\":%d,\"cmd\":", i);
+        json_string(out, p->name);
+        fprintf(out, ",\"pid\":%d,\"parse_us\":%.1f,\"fork_us\":%.1f,"
+                "\"exec_us\":%.1f,\"wait_us\":%.1f,\"user_us\":%.0f,"
+                "\"sys_us\":%.0f,\"status\":%d}\n",
+                p->pid, j->parse_us,
+                timespec_us(&p->fork_start, &p->fork_end),
+                timespec_us(&p->fork_end, &p->exec_end),
+                timespec_us(&p->exec_end, &p->finished),
+                timeval_us(&p->rusage.ru_utime),
+                timeval_us(&p->rusage.ru_stime),
+                job_exit_code(p->status));
+
+        fclose(out);
+        write(trace_fd, record, size);
+        free(record);
+    }
+}
+
+static void print_time(const char *name, double us) {
+    long long ms = (long long) (us / 1e3);
+    fprintf(stderr, "%s\t%lldm%lld.%03llds\n", name,
+            ms / 60000, ms / 1000 % 60, ms % 1000);
+}
+
+double job_real_us(struct job *j) {
+    if (!j->num_procs)
+        return 0;
+
+    // wall time is from the first fork to the last reap
+    struct timespec start = j->procs[0].fork_start;
+    struct timespec end = start;
+
+    for (int i = 0; i < j->num_procs; ++i) {
+        if (timespec_us(&j->procs[i].fork_start, &start) > 0)
+            start = j->procs[i].fork_start;
+        if (timespec_us(&end, &j->procs[i].finished) > 0)
+            end = j->procs[i].finished;
+    }
+
+    return timespec_us(&start, &end);
+}
+
+void time_report(struct job *j) {
+    if (!j->num_procs)
+        return;
+
+    double user = 0, sys = 0;
+    for (int i = 0; i < j->num_procs; ++i) {
+        user += timeval_us(&j->procs[i].rusage.ru_utime);
+        sys += timeval_us(&j->procs[i].rusage.ru_stime);
+    }
+
+    fprintf(stderr, "\n");
+    print_time("real", job_real_us(j));
+    print_time("user", user);
+    print_time("sys", sys);
+
+    if (j->num_procs < 2)
+        return;
+
+    for (int i = 0; i < j->num_procs; ++i) {
+        struct job_proc *p = &j->procs[i];
+        fprintf(stderr, "  [%d] %s\treal %.3fs\tuser %.3fs\tsys %.3fs\n",
+                i, p->name,
+                timespec_us(&p->fork_start, &p->finished) / 1e6,
+                timeval_us(&p->rusage.ru_utime) / 1e6,
+                timeval_us(&p->rusage.ru_stime) / 1e6);
+    }
+}
@@ -0,0 +1,37 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <time.h>
+
+#include "jobs.h"
+
+/*
+ * Timing of the shell. Trace mode is enabled with SHELL_TRACE
+ * environment variable: a file name, or "1" for stderr. In this
+ * mode every stage of every pipeline is logged as a JSON line
+ * with parse, fork, exec and wait latencies.
+ */
+
+void trace_init(void);
+
+bool trace_enabled(void);
+
+// parse time is accumulated for the current command line
+void trace_line_reset(void);
+
+void trace_parse_begin(void);
+
+void trace_parse_end(void);
+
+double trace_parse_us(void);
+
+double timespec_us(const struct timespec *from, const struct timespec *to);
+
+double job_real_us(struct job *j);
+
+void trace_job(struct job *j);
+
+void time_report(struct job *j);
+
+#endif /* TRACE_H */
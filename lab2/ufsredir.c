@@ -0,0 +1,180 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ufsredir.h"
+#include "userfs.h"
+
+// bytes moved by one ufs_read
+#define UFS_CHUNK (1 << 16)
+
+static const char *ufs_strerror(enum ufs_error_code code) {
+    switch (code) {
+        case UFS_ERR_NO_FILE: return "No such file";
+        case UFS_ERR_NO_MEM: return "Not enough memory";
+        case UFS_ERR_NO_PERMISSION: return "Permission denied";
+        case UFS_ERR_NOT_IMPLEMENTED: return "Not implemented";
+        case UFS_ERR_IO: return "Input/output error";
+        default: return "Unknown error";
+    }
+}
+
+// userfs of a forked subshell is a copy, output to it is lost
+static bool in_subshell = false;
+
+void ufs_redirect_forked(void) {
+    in_subshell = true;
+}
+
+bool is_ufs_path(const char *fname) {
+    return !strncmp(fname, UFS_PREFIX, strlen(UFS_PREFIX));
+}
+
+static const char *ufs_name(const char *fname) {
+    return fname + strlen(UFS_PREFIX);
+}
+
+static int write_all(int fd, const char *data, size_t size) {
+    while (size) {
+        ssize_t n = write(fd, data, size);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += n;
+        size -= n;
+    }
+    return 0;
+}
+
+int ufs_redirect_input(const char *fname) {
+    int ufd = ufs_open(ufs_name(fname), UFS_READ_ONLY);
+    if (ufd == -1) {
+        fprintf(stderr, "%s: %s\n", fname, ufs_strerror(ufs_errno()));
+        return -1;
+    }
+
+    int fd = memfd_create(fname, MFD_CLOEXEC);
+    if (fd == -1) {
+        perror("memfd_create");
+        ufs_close(ufd);
+        return -1;
+    }
+
+    char *buf = malloc(UFS_CHUNK);
+    ssize_t n;
+    while ((n = ufs_read(ufd, buf, UFS_CHUNK)) > 0) {
+        if (write_all(fd, buf, n)) {
+            perror(fname);
+            break;
+        }
+    }
+    free(buf);
+    ufs_close(ufd);
+
+    if (n != 0) {
+        close(fd);
+        return -1;
+    }
+
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+int ufs_redirect_output(struct job *j, const char *fname, bool append) {
+    if (in_subshell) {
+        fprintf(stderr, "%s: Output to userfs is not supported in a subshell\n", fname);
+        return -1;
+    }
+
+    int fd = memfd_create(fname, MFD_CLOEXEC);
+    if (fd == -1) {
+        perror("memfd_create");
+        return -1;
+    }
+
+    int job_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (job_fd == -1) {
+        perror("fcntl");
+        close(fd);
+        return -1;
+    }
+
+    // O_APPEND of the memfd does not matter, the data is added to
+    // the userfs file on commit
+    j->ufs_outputs = realloc(j->ufs_outputs,
+                             sizeof(struct ufs_output) * (++j->num_ufs_outputs));
+    j->ufs_outputs[j->num_ufs_outputs - 1] = (struct ufs_output) {
+        .name = strdup(ufs_name(fname)),
+        .fd = job_fd,
+        .append = append,
+    };
+
+    return fd;
+}
+
+static void ufs_output_commit(struct ufs_output *o) {
+    struct stat st;
+    if (fstat(o->fd, &st)) {
+        perror("ufs: stat");
+        return;
+    }
+
+    int ufd = ufs_open(o->name, UFS_CREATE | UFS_READ_WRITE);
+    if (ufd == -1) {
+        fprintf(stderr, UFS_PREFIX "%s: %s\n", o->name, ufs_strerror(ufs_errno()));
+        return;
+    }
+
+    // append goes at the file end, a truncated file is written
+    // from 0 which is also what ufs_resize returns
+    ssize_t offset = o->append ? ufs_size(ufd) : ufs_resize(ufd, 0);
+    int ret = offset == -1 ? -1 : 0;
+
+    if (!ret && st.st_size > 0) {
+        // written to userfs right from the memfd pages
+        char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, o->fd, 0);
+        if (data == MAP_FAILED) {
+            perror("ufs: mmap");
+        } else {
+            size_t done = 0;
+            while (done < st.st_size) {
+                ssize_t n = ufs_pwrite(ufd, data + done, st.st_size - done, offset + done);
+                if (n <= 0) {
+                    ret = -1;
+                    break;
+                }
+                done += n;
+            }
+            munmap(data, st.st_size);
+        }
+    }
+
+    if (ret)
+        fprintf(stderr, UFS_PREFIX "%s: %s\n", o->name, ufs_strerror(ufs_errno()));
+
+    ufs_close(ufd);
+}
+
+void ufs_outputs_commit(struct job *j) {
+    for (int i = 0; i < j->num_ufs_outputs; ++i)
+        ufs_output_commit(&j->ufs_outputs[i]);
+}
+
+void ufs_outputs_free(struct job *j) {
+    for (int i = 0; i < j->num_ufs_outputs; ++i) {
+        free(j->ufs_outputs[i].name);
+        close(j->ufs_outputs[i].fd);
+    }
+    free(j->ufs_outputs);
+    j->ufs_outputs = NULL;
+    j->num_ufs_outputs = 0;
+}
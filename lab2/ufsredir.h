@@ -0,0 +1,45 @@
+#ifndef UFSREDIR_H
+#define UFSREDIR_H
+
+#include <stdbool.h>
+
+#include "jobs.h"
+
+/*
+ * Redirects to "ufs:NAME" go to the in-memory filesystem of
+ * lab3/userfs.c, which lives in the shell process. Commands get a
+ * memfd instead of a file: for `<` it is filled from userfs before
+ * the command starts, for `>` and `>>` its content is written to
+ * userfs when the job finishes. Scratch data never touches a disk
+ * and is gone when the shell exits. A background chain or a
+ * parallel line runs in a forked subshell with a copy of the
+ * files, so `>` to userfs is refused there.
+ */
+
+#define UFS_PREFIX "ufs:"
+
+struct ufs_output {
+    char *name;
+    int fd;
+    bool append;
+};
+
+bool is_ufs_path(const char *fname);
+
+// called in a forked subshell: its output redirects to userfs
+// fail, the data would stay in the child's copy of the files
+void ufs_redirect_forked(void);
+
+// returns memfd with the file content, -1 on error
+int ufs_redirect_input(const char *fname);
+
+// returns memfd for the command output, -1 on error; the job
+// keeps its own reference to commit it later
+int ufs_redirect_output(struct job *j, const char *fname, bool append);
+
+// writes outputs of the finished job to userfs
+void ufs_outputs_commit(struct job *j);
+
+void ufs_outputs_free(struct job *j);
+
+#endif /* UFSREDIR_H */
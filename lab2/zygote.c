@@ -0,0 +1,299 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "zygote.h"
+
+// biggest request: path and argv of one command
+#define ZYGOTE_MSG_MAX (1 << 16)
+// stdin, stdout, stderr, working directory and the exec
+// notification pipe
+#define ZYGOTE_MAX_FDS 5
+
+struct zygote_req {
+    int32_t pgid;
+    int32_t argc;
+    // length of the path without '\0', 0 if there is no path
+    int32_t path_len;
+    uint8_t tty;
+    uint8_t has_exec_fd;
+    // followed by the path and argv strings, '\0'-terminated
+};
+
+static int zygote_sock = -1;
+static pid_t zygote_pid = 0;
+
+
+// clone(CLONE_PARENT) makes the new process a sibling of the
+// zygote, so it is the shell who gets its SIGCHLD and status
+static pid_t clone_parent(void) {
+    return syscall(SYS_clone, CLONE_PARENT | SIGCHLD, NULL, NULL, NULL, NULL);
+}
+
+static void zygote_child(struct zygote_req *req, const char *path,
+                         char **argv, int *fds) {
+    if (req->pgid != -1) {
+        pid_t pgid = req->pgid ? req->pgid : getpid();
+        setpgid(0, pgid);
+
+        // stdin of the zygote is the terminal of the shell
+        if (req->tty)
+            tcsetpgrp(STDIN_FILENO, pgid);
+    }
+
+    for (int i = 0; i < 3; ++i) {
+        if (dup2(fds[i], i) == -1) {
+            perror("zygote: dup2");
+            _exit(1);
+        }
+    }
+
+    // zygote stays where the shell was started
+    if (fchdir(fds[3])) {
+        perror("zygote: fchdir");
+        _exit(1);
+    }
+
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+    signal(SIGTTOU, SIG_DFL);
+
+    // received descriptors and the socket are closed on exec
+    if (path)
+        execv(path, argv);
+    execvp(argv[0], argv);
+    _exit(1);
+}
+
+// starts the command of one request, returns pid or -errno
+static pid_t zygote_handle(struct zygote_req *req, size_t size, int *fds, int num_fds) {
+    if (size < sizeof(*req) || req->argc <= 0 || num_fds != 4 + req->has_exec_fd)
+        return -EINVAL;
+
+    char *data = (char *) (req + 1);
+    char *end = (char *) req + size;
+    const char *path = NULL;
+
+    if (req->path_len) {
+        if (req->path_len >= end - data || data[req->path_len])
+            return -EINVAL;
+        path = data;
+        data += req->path_len + 1;
+    }
+
+    char **argv = malloc(sizeof(char *) * (req->argc + 1));
+    for (int i = 0; i < req->argc; ++i) {
+        char *arg_end = memchr(data, '\0', end - data);
+        if (!arg_end) {
+            free(argv);
+            return -EINVAL;
+        }
+        argv[i] = data;
+        data = arg_end + 1;
+    }
+    argv[req->argc] = NULL;
+
+    pid_t pid = clone_parent();
+    if (!pid)
+        zygote_child(req, path, argv, fds);
+
+    free(argv);
+    return pid == -1 ? -errno : pid;
+}
+
+static void zygote_loop(int sock) {
+    // same as the interactive shell, so children can take the
+    // terminal before they reset these
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+
+    char *buf = malloc(ZYGOTE_MSG_MAX);
+
+    while (true) {
+        union {
+            char data[CMSG_SPACE(sizeof(int) * ZYGOTE_MAX_FDS)];
+            struct cmsghdr align;
+        } control;
+        struct iovec iov = {.iov_base = buf, .iov_len = ZYGOTE_MSG_MAX};
+        struct msghdr msg = {
+            .msg_iov = &iov,
+            .msg_iovlen = 1,
+            .msg_control = control.data,
+            .msg_controllen = sizeof(control.data),
+        };
+
+        ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        if (n == -1 && errno == EINTR)
+            continue;
+        // shell is gone
+        if (n <= 0)
+            _exit(0);
+
+        int fds[ZYGOTE_MAX_FDS];
+        int num_fds = 0;
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * num_fds);
+        }
+
+        int32_t reply = zygote_handle((struct zygote_req *) buf, n, fds, num_fds);
+
+        for (int i = 0; i < num_fds; ++i)
+            close(fds[i]);
+
+        while (send(sock, &reply, sizeof(reply), MSG_NOSIGNAL) == -1) {
+            if (errno != EINTR)
+                _exit(1);
+        }
+    }
+}
+
+bool zygote_start(void) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv)) {
+        perror("zygote: socketpair");
+        return false;
+    }
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("zygote: fork");
+        close(sv[0]);
+        close(sv[1]);
+        return false;
+    }
+
+    if (!pid) {
+        close(sv[0]);
+        zygote_loop(sv[1]);
+    }
+
+    close(sv[1]);
+    zygote_sock = sv[0];
+    zygote_pid = pid;
+    return true;
+}
+
+bool zygote_enabled(void) {
+    return zygote_sock != -1;
+}
+
+void zygote_detach(void) {
+    if (zygote_sock != -1)
+        close(zygote_sock);
+    zygote_sock = -1;
+    zygote_pid = 0;
+}
+
+// zygote does not answer, commands are forked by the shell from now on
+static void zygote_lost(void) {
+    fprintf(stderr, "zygote: helper is not responding, using fork\n");
+    kill(zygote_pid, SIGKILL);
+    waitpid(zygote_pid, NULL, 0);
+    zygote_detach();
+}
+
+pid_t zygote_spawn(const struct zygote_cmd *cmd) {
+    if (zygote_sock == -1)
+        return -1;
+
+    size_t size = sizeof(struct zygote_req);
+    size_t path_len = cmd->path ? strlen(cmd->path) : 0;
+    if (path_len)
+        size += path_len + 1;
+    for (int i = 0; i < cmd->argc; ++i)
+        size += strlen(cmd->argv[i]) + 1;
+
+    // too long to pass in one message, shell forks it itself
+    if (size > ZYGOTE_MSG_MAX)
+        return -1;
+
+    char *buf = malloc(size);
+    struct zygote_req *req = (struct zygote_req *) buf;
+    *req = (struct zygote_req) {
+        .pgid = cmd->pgid,
+        .argc = cmd->argc,
+        .path_len = path_len,
+        .tty = cmd->tty,
+        .has_exec_fd = cmd->exec_fd != -1,
+    };
+
+    char *data = (char *) (req + 1);
+    if (path_len) {
+        memcpy(data, cmd->path, path_len + 1);
+        data += path_len + 1;
+    }
+    for (int i = 0; i < cmd->argc; ++i) {
+        size_t len = strlen(cmd->argv[i]) + 1;
+        memcpy(data, cmd->argv[i], len);
+        data += len;
+    }
+
+    int cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (cwd == -1) {
+        free(buf);
+        return -1;
+    }
+
+    int fds[ZYGOTE_MAX_FDS] = {cmd->fds[0], cmd->fds[1], cmd->fds[2], cwd, cmd->exec_fd};
+    int num_fds = req->has_exec_fd ? 5 : 4;
+
+    union {
+        char data[CMSG_SPACE(sizeof(int) * ZYGOTE_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct iovec iov = {.iov_base = buf, .iov_len = size};
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.data,
+        .msg_controllen = CMSG_SPACE(sizeof(int) * num_fds),
+    };
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * num_fds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * num_fds);
+
+    ssize_t n;
+    while ((n = sendmsg(zygote_sock, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR);
+    free(buf);
+    close(cwd);
+
+    if (n == -1) {
+        zygote_lost();
+        return -1;
+    }
+
+    int32_t reply;
+    while ((n = recv(zygote_sock, &reply, sizeof(reply), 0)) == -1 && errno == EINTR);
+
+    if (n != sizeof(reply)) {
+        zygote_lost();
+        return -1;
+    }
+
+    if (reply < 0) {
+        errno = -reply;
+        return -1;
+    }
+
+    return reply;
+}
@@ -0,0 +1,45 @@
+#ifndef ZYGOTE_H
+#define ZYGOTE_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/*
+ * Zygote is a small helper forked when the shell starts, before
+ * it has allocated anything. Commands are sent to it over a unix
+ * socket together with their stdin/stdout/stderr (SCM_RIGHTS),
+ * and the shell's working directory, and it starts them with
+ * clone(CLONE_PARENT): they become the shell's children, but the
+ * cost of creating them does not grow with the shell's memory.
+ */
+
+struct zygote_cmd {
+    // resolved path of the command, NULL to search PATH
+    const char *path;
+    char **argv;
+    int argc;
+
+    // process group to join, 0 for a new group, -1 to stay in
+    // the shell's one
+    pid_t pgid;
+    // give the terminal to the process group
+    bool tty;
+
+    // become stdin, stdout and stderr of the command
+    int fds[3];
+    // closed by a successful exec, -1 if not needed
+    int exec_fd;
+};
+
+bool zygote_start(void);
+
+bool zygote_enabled(void);
+
+// forgets the zygote in a forked shell: its children would
+// become children of the parent shell, not of this process
+void zygote_detach(void);
+
+// returns pid of the started command, -1 if it was not started
+pid_t zygote_spawn(const struct zygote_cmd *cmd);
+
+#endif /* ZYGOTE_H */
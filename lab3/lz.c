@@ -0,0 +1,189 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+enum {
+	/** Shorter matches cost more than the literals. */
+	LZ_MIN_MATCH = 4,
+	/** Offset field is 2 bytes. */
+	LZ_MAX_OFFSET = 65535,
+	/** Table of 4-byte prefixes, 32KB on the stack. */
+	LZ_HASH_BITS = 13,
+	/** A token field of this value is continued by extra bytes. */
+	LZ_FIELD_MAX = 15,
+	/**
+	 * Every 2^LZ_SKIP_SHIFT bytes without a match the search
+	 * step grows by one, so incompressible data is passed fast.
+	 */
+	LZ_SKIP_SHIFT = 6,
+};
+
+
+static uint32_t read32(const char *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t hash32(uint32_t v) {
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/** Bytes to encode the extra part of a length field. */
+static size_t length_bytes(size_t len) {
+	return len < LZ_FIELD_MAX ? 0 : (len - LZ_FIELD_MAX) / 255 + 1;
+}
+
+static char *put_length(char *op, size_t len) {
+	if (len < LZ_FIELD_MAX)
+		return op;
+
+	len -= LZ_FIELD_MAX;
+	while (len >= 255) {
+		*op++ = (char) 255;
+		len -= 255;
+	}
+	*op++ = (char) len;
+	return op;
+}
+
+/**
+ * Writes literals and a match after them, @a match_len is 0 for
+ * the last sequence. Returns the new output end, NULL if the
+ * sequence does not fit.
+ */
+static char *put_sequence(char *op, const char *oend, const char *lit,
+			  size_t lit_len, size_t offset, size_t match_len) {
+	size_t ml = match_len ? match_len - LZ_MIN_MATCH : 0;
+	size_t need = 1 + length_bytes(lit_len) + lit_len;
+	if (match_len)
+		need += 2 + length_bytes(ml);
+
+	if (need > (size_t) (oend - op))
+		return NULL;
+
+	size_t lit_field = lit_len < LZ_FIELD_MAX ? lit_len : LZ_FIELD_MAX;
+	size_t ml_field = ml < LZ_FIELD_MAX ? ml : LZ_FIELD_MAX;
+	*op++ = (char) (lit_field << 4 | ml_field);
+
+	op = put_length(op, lit_len);
+	memcpy(op, lit, lit_len);
+	op += lit_len;
+
+	if (match_len) {
+		*op++ = (char) (offset & 0xff);
+		*op++ = (char) (offset >> 8);
+		op = put_length(op, ml);
+	}
+
+	return op;
+}
+
+size_t
+lz_compress(const char *src, size_t size, char *dst, size_t capacity)
+{
+	uint32_t table[1 << LZ_HASH_BITS];
+	memset(table, 0, sizeof(table));
+
+	const char *ip = src;
+	const char *anchor = src;
+	const char *end = src + size;
+	char *op = dst;
+	const char *oend = dst + capacity;
+
+	// table slots point to the start until they are filled, the
+	// prefix check rejects them
+	while (size >= LZ_MIN_MATCH && ip <= end - LZ_MIN_MATCH) {
+		uint32_t seq = read32(ip);
+		uint32_t h = hash32(seq);
+		const char *ref = src + table[h];
+		table[h] = ip - src;
+
+		if (ref >= ip || ip - ref > LZ_MAX_OFFSET || read32(ref) != seq) {
+			ip += 1 + ((ip - anchor) >> LZ_SKIP_SHIFT);
+			continue;
+		}
+
+		size_t len = LZ_MIN_MATCH;
+		while (ip + len < end && ref[len] == ip[len])
+			++len;
+
+		op = put_sequence(op, oend, anchor, ip - anchor, ip - ref, len);
+		if (!op)
+			return 0;
+
+		ip += len;
+		anchor = ip;
+	}
+
+	op = put_sequence(op, oend, anchor, end - anchor, 0, 0);
+	return op ? (size_t) (op - dst) : 0;
+}
+
+/**
+ * Reads the extra part of a length field. 0 on success, -1 if
+ * the input ends.
+ */
+static int get_length(const unsigned char **ip, const unsigned char *iend, size_t *len) {
+	unsigned char b;
+	do {
+		if (*ip >= iend)
+			return -1;
+		b = *(*ip)++;
+		*len += b;
+	} while (b == 255);
+	return 0;
+}
+
+ptrdiff_t
+lz_decompress(const char *src, size_t size, char *dst, size_t capacity)
+{
+	const unsigned char *ip = (const unsigned char *) src;
+	const unsigned char *iend = ip + size;
+	char *op = dst;
+	char *oend = dst + capacity;
+
+	while (ip < iend) {
+		unsigned token = *ip++;
+
+		size_t lit = token >> 4;
+		if (lit == LZ_FIELD_MAX && get_length(&ip, iend, &lit))
+			return -1;
+		if (lit > (size_t) (iend - ip) || lit > (size_t) (oend - op))
+			return -1;
+
+		memcpy(op, ip, lit);
+		op += lit;
+		ip += lit;
+
+		// the last sequence has no match
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		size_t offset = ip[0] | (size_t) ip[1] << 8;
+		ip += 2;
+
+		size_t len = token & LZ_FIELD_MAX;
+		if (len == LZ_FIELD_MAX && get_length(&ip, iend, &len))
+			return -1;
+		len += LZ_MIN_MATCH;
+
+		if (!offset || offset > (size_t) (op - dst) || len > (size_t) (oend - op))
+			return -1;
+
+		// an overlapping match repeats the pattern: every copy
+		// doubles the part which can be copied at once
+		const char *ref = op - offset;
+		while (len) {
+			size_t n = (size_t) (op - ref) < len ? (size_t) (op - ref) : len;
+			memcpy(op, ref, n);
+			op += n;
+			len -= n;
+		}
+	}
+
+	return op - dst;
+}
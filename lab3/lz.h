@@ -0,0 +1,42 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+
+/**
+ * Fast LZ77 compressor for cold file data of userfs. The stream
+ * is a sequence of: a token byte with the literal count in the
+ * high 4 bits and the match length minus 4 in the low 4 bits,
+ * extra length bytes when a field is 15, the literals, and a
+ * 2-byte little-endian offset of the match. The last sequence has
+ * only literals. Matches are found through a hash table of 4-byte
+ * prefixes, one candidate per slot, so it trades ratio for speed.
+ */
+
+/**
+ * Compress a buffer.
+ * @param src Data to compress.
+ * @param size Size of @a src.
+ * @param dst Output buffer.
+ * @param capacity Size of @a dst.
+ *
+ * @retval > 0 Size of the compressed data.
+ * @retval 0 The compressed data does not fit into @a capacity.
+ */
+size_t
+lz_compress(const char *src, size_t size, char *dst, size_t capacity);
+
+/**
+ * Decompress a buffer.
+ * @param src Data from lz_compress().
+ * @param size Size of @a src.
+ * @param dst Output buffer.
+ * @param capacity Size of @a dst.
+ *
+ * @retval >= 0 Size of the decompressed data.
+ * @retval -1 The data is broken or does not fit into @a capacity.
+ */
+ptrdiff_t
+lz_decompress(const char *src, size_t size, char *dst, size_t capacity);
+
+#endif /* LZ_H */
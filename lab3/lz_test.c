@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lz.h"
+
+/**
+ * Round trips of the LZ compressor on data of every kind, and
+ * checks that broken input is rejected instead of read or written
+ * out of bounds.
+ *
+ *     make check
+ */
+
+#define CHECK(cond) do {						\
+	if (!(cond)) {							\
+		fprintf(stderr, "%s:%d: check failed: %s\n",		\
+			__FILE__, __LINE__, #cond);			\
+		exit(1);						\
+	}								\
+} while (0)
+
+enum {
+	MAX_SIZE = 1024 * 1024,
+};
+
+/** A compressed buffer can be a bit bigger than the input. */
+static size_t bound(size_t size) {
+	return size + size / 255 + 16;
+}
+
+/** Compresses and decompresses, returns the compressed size. */
+static size_t round_trip(const char *data, size_t size) {
+	size_t capacity = bound(size);
+	char *packed = malloc(capacity);
+	char *back = malloc(size + 1);
+
+	size_t packed_size = lz_compress(data, size, packed, capacity);
+	CHECK(packed_size > 0 && packed_size <= capacity);
+	CHECK(lz_decompress(packed, packed_size, back, size) == (ptrdiff_t) size);
+	CHECK(size == 0 || memcmp(data, back, size) == 0);
+
+	// the output does not fit one byte less
+	if (size > 0)
+		CHECK(lz_decompress(packed, packed_size, back, size - 1) == -1);
+
+	// a compressed buffer of the exact size is enough, one less
+	// byte is not
+	CHECK(lz_compress(data, size, packed, packed_size) == packed_size);
+	CHECK(lz_compress(data, size, packed, packed_size - 1) == 0);
+
+	free(packed);
+	free(back);
+	return packed_size;
+}
+
+static void test_round_trip(void) {
+	char *data = malloc(MAX_SIZE);
+
+	// tiny inputs are all literals
+	round_trip("", 0);
+	round_trip("a", 1);
+	round_trip("abcd", 4);
+	round_trip("abcdabcd", 8);
+
+	// a run is one overlapping match, long lengths take extra
+	// bytes
+	size_t sizes[] = {5, 15, 16, 19, 20, 270, 271, 300, 4096, MAX_SIZE};
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+		memset(data, 'z', sizes[i]);
+		size_t packed = round_trip(data, sizes[i]);
+		CHECK(sizes[i] < 4096 || packed < sizes[i] / 100);
+	}
+
+	// short periods repeat through overlapping matches
+	for (int period = 1; period <= 16; ++period) {
+		for (size_t k = 0; k < 10000; ++k)
+			data[k] = (char) ('a' + k % period);
+		round_trip(data, 10000);
+	}
+
+	// random data does not compress and stays within the bound
+	srand(7);
+	for (size_t k = 0; k < MAX_SIZE; ++k)
+		data[k] = (char) rand();
+	round_trip(data, MAX_SIZE);
+	for (size_t size = 1; size < 600; size += 7)
+		round_trip(data, size);
+
+	// text-like data with matches far apart and beyond the max
+	// offset
+	size_t pos = 0;
+	for (int line = 0; pos < MAX_SIZE - 100; ++line) {
+		pos += snprintf(data + pos, MAX_SIZE - pos, "line %d: value=%d\n",
+				line, line * 7919 % 1000);
+	}
+	memset(data + pos, ' ', MAX_SIZE - pos);
+	size_t packed = round_trip(data, MAX_SIZE);
+	CHECK(packed < MAX_SIZE / 2);
+
+	// random blocks repeated at growing distances
+	for (size_t k = 0; k < 1000; ++k)
+		data[k] = (char) rand();
+	for (size_t copy = 1; (copy + 1) * 1000 * copy < MAX_SIZE; ++copy)
+		memcpy(data + copy * 1000 * copy, data, 1000);
+	round_trip(data, MAX_SIZE);
+
+	free(data);
+}
+
+static void test_broken(void) {
+	char data[4096];
+	char packed[4096 + 64];
+	char back[4096];
+	for (size_t k = 0; k < sizeof(data); ++k)
+		data[k] = (char) ('a' + k % 13 + k / 500);
+	size_t packed_size = lz_compress(data, sizeof(data), packed, sizeof(packed));
+	CHECK(packed_size > 0);
+
+	// every cut of the stream is rejected or gives a prefix
+	for (size_t cut = 0; cut < packed_size; ++cut) {
+		ptrdiff_t n = lz_decompress(packed, cut, back, sizeof(back));
+		CHECK(n == -1 || (n <= (ptrdiff_t) sizeof(data) && memcmp(back, data, n) == 0));
+	}
+
+	// a match before the output start
+	char bad_offset[] = {0x10, 'a', 0x05, 0x00};
+	CHECK(lz_decompress(bad_offset, sizeof(bad_offset), back, sizeof(back)) == -1);
+	// a zero offset
+	char zero_offset[] = {0x10, 'a', 0x00, 0x00};
+	CHECK(lz_decompress(zero_offset, sizeof(zero_offset), back, sizeof(back)) == -1);
+	// a literal count past the input end
+	char long_literals[] = {(char) 0xf0, (char) 0xff};
+	CHECK(lz_decompress(long_literals, sizeof(long_literals), back, sizeof(back)) == -1);
+
+	// random bytes never go out of bounds; run it under
+	// -fsanitize=address to check
+	srand(11);
+	for (int round = 0; round < 10000; ++round) {
+		char noise[64];
+		size_t size = rand() % sizeof(noise);
+		for (size_t k = 0; k < size; ++k)
+			noise[k] = (char) rand();
+		ptrdiff_t n = lz_decompress(noise, size, back, rand() % sizeof(back));
+		CHECK(n >= -1 && n <= (ptrdiff_t) sizeof(back));
+	}
+
+	// flipped bytes of a valid stream
+	for (int round = 0; round < 10000; ++round) {
+		char copy[sizeof(packed)];
+		memcpy(copy, packed, packed_size);
+		copy[rand() % packed_size] ^= (char) (1 + rand() % 255);
+		ptrdiff_t n = lz_decompress(copy, packed_size, back, sizeof(back));
+		CHECK(n >= -1 && n <= (ptrdiff_t) sizeof(back));
+	}
+}
+
+int main(void) {
+	test_round_trip();
+	printf("ok - round trip\n");
+	test_broken();
+	printf("ok - broken input\n");
+	return 0;
+}
@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "userfs.h"
+
+/**
+ * Read scaling of userfs: threads read one shared file, each
+ * through its own descriptor, and the throughput is printed for
+ * 1, 2, 4, ... threads. Readers take the file lock shared, so the
+ * throughput should grow with the number of cores.
+ *
+ *     gcc -O2 -pthread scaling.c userfs.c slab.c lz.c -o scaling
+ *     ./scaling [max threads] [file MB] [passes]
+ */
+
+enum {
+	READ_SIZE = 4096,
+};
+
+static size_t file_size;
+static int passes;
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *reader(void *arg) {
+	char buf[READ_SIZE];
+	int fd = ufs_open("scaling", UFS_READ_ONLY);
+	if (fd == -1) {
+		fprintf(stderr, "open: error %d\n", ufs_errno());
+		exit(1);
+	}
+
+	for (int i = 0; i < passes; ++i) {
+		for (size_t offset = 0; offset < file_size; offset += READ_SIZE) {
+			if (ufs_pread(fd, buf, READ_SIZE, offset) != READ_SIZE) {
+				fprintf(stderr, "pread: error %d\n", ufs_errno());
+				exit(1);
+			}
+		}
+	}
+
+	ufs_close(fd);
+	return NULL;
+}
+
+int main(int argc, char **argv) {
+	int max_threads = argc > 1 ? atoi(argv[1]) : 8;
+	file_size = (size_t) (argc > 2 ? atoi(argv[2]) : 64) << 20;
+	passes = argc > 3 ? atoi(argv[3]) : 4;
+
+	int fd = ufs_open("scaling", UFS_CREATE);
+	char *data = malloc(file_size);
+	memset(data, 'x', file_size);
+	if (ufs_write(fd, data, file_size) != (ssize_t) file_size) {
+		fprintf(stderr, "write: error %d\n", ufs_errno());
+		return 1;
+	}
+	free(data);
+
+	pthread_t *threads = malloc(sizeof(pthread_t) * max_threads);
+	for (int n = 1; n <= max_threads; n *= 2) {
+		double start = now();
+		for (int i = 0; i < n; ++i)
+			pthread_create(&threads[i], NULL, reader, NULL);
+		for (int i = 0; i < n; ++i)
+			pthread_join(threads[i], NULL);
+		double sec = now() - start;
+
+		double mb = (double) file_size * passes * n / (1 << 20);
+		printf("%2d threads: %8.0f MB/s\n", n, mb / sec);
+	}
+
+	free(threads);
+	ufs_close(fd);
+	ufs_delete("scaling");
+	return 0;
+}
@@ -0,0 +1,245 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "slab.h"
+
+enum {
+	/** Size classes: SLAB_MIN_OBJECT << i up to SLAB_MAX_OBJECT. */
+	SLAB_NUM_CLASSES = 13,
+	/** Objects start after the chunk header, aligned to this. */
+	SLAB_ALIGN = 64,
+};
+
+/** Freed object, it keeps the link to the next free one. */
+struct slab_free_obj {
+	struct slab_free_obj *next;
+};
+
+/** Header in the beginning of every chunk. */
+struct slab_chunk {
+	/** Size class of all the objects in the chunk. */
+	int cls;
+	/** Objects given out and not freed. */
+	size_t used;
+	/** Objects ever carved out of the chunk. */
+	size_t carved;
+	/** How many objects fit into the chunk. */
+	size_t capacity;
+	/** Freed objects of the chunk. */
+	struct slab_free_obj *free_list;
+	/** Chunks of the class which have free objects. */
+	struct slab_chunk *next;
+	struct slab_chunk *prev;
+};
+
+/** Chunks with free objects, per size class. */
+static struct slab_chunk *partial[SLAB_NUM_CLASSES];
+/**
+ * One empty chunk per class is kept mapped, with its pages given
+ * back, so a single object allocated and freed in a loop does not
+ * map and unmap a chunk every time.
+ */
+static struct slab_chunk *spare[SLAB_NUM_CLASSES];
+
+/** Guards the chunk lists, userfs calls in from many threads. */
+static pthread_mutex_t slab_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Counters for slab_stats(). Big objects go without the lock. */
+static size_t num_chunks = 0;
+static size_t used_bytes = 0;
+static size_t big_objects = 0;
+static size_t big_bytes = 0;
+
+
+static int size_class(size_t size) {
+	int cls = 0;
+	while ((size_t) SLAB_MIN_OBJECT << cls < size)
+		++cls;
+	return cls;
+}
+
+static size_t class_size(int cls) {
+	return (size_t) SLAB_MIN_OBJECT << cls;
+}
+
+static size_t first_object_offset(void) {
+	return (sizeof(struct slab_chunk) + SLAB_ALIGN - 1) & ~(size_t) (SLAB_ALIGN - 1);
+}
+
+static char *chunk_object(struct slab_chunk *c, size_t idx) {
+	return (char *) c + first_object_offset() + idx * class_size(c->cls);
+}
+
+/** Maps a chunk aligned to its size. */
+static void *map_aligned_chunk(void) {
+	size_t size = (size_t) SLAB_CHUNK_SIZE * 2;
+	char *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		return NULL;
+
+	// trim the head and the tail around the aligned part
+	uintptr_t start = ((uintptr_t) mem + SLAB_CHUNK_SIZE - 1)
+			  & ~(uintptr_t) (SLAB_CHUNK_SIZE - 1);
+	size_t head = start - (uintptr_t) mem;
+	if (head)
+		munmap(mem, head);
+	munmap((char *) start + SLAB_CHUNK_SIZE, SLAB_CHUNK_SIZE - head);
+
+	return (void *) start;
+}
+
+static void partial_push(struct slab_chunk *c) {
+	c->prev = NULL;
+	c->next = partial[c->cls];
+	if (c->next)
+		c->next->prev = c;
+	partial[c->cls] = c;
+}
+
+static void partial_remove(struct slab_chunk *c) {
+	if (c->prev)
+		c->prev->next = c->next;
+	else
+		partial[c->cls] = c->next;
+
+	if (c->next)
+		c->next->prev = c->prev;
+
+	c->next = c->prev = NULL;
+}
+
+static struct slab_chunk *new_chunk(int cls) {
+	struct slab_chunk *c = spare[cls];
+	spare[cls] = NULL;
+
+	if (!c) {
+		if (!(c = map_aligned_chunk()))
+			return NULL;
+		++num_chunks;
+	}
+
+	*c = (struct slab_chunk) {
+		.cls = cls,
+		.used = 0,
+		.carved = 0,
+		.capacity = (SLAB_CHUNK_SIZE - first_object_offset()) / class_size(cls),
+		.free_list = NULL,
+		.next = NULL,
+		.prev = NULL,
+	};
+
+	partial_push(c);
+	return c;
+}
+
+static size_t page_round(size_t size) {
+	size_t page = 4096;
+	return (size + page - 1) & ~(page - 1);
+}
+
+void *
+slab_alloc(size_t size)
+{
+	if (size > SLAB_MAX_OBJECT) {
+		void *mem = mmap(NULL, page_round(size), PROT_READ | PROT_WRITE,
+				 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mem == MAP_FAILED)
+			return NULL;
+
+		__atomic_add_fetch(&big_objects, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&big_bytes, page_round(size), __ATOMIC_RELAXED);
+		return mem;
+	}
+
+	int cls = size_class(size);
+	pthread_mutex_lock(&slab_lock);
+
+	struct slab_chunk *c = partial[cls];
+	if (!c && !(c = new_chunk(cls))) {
+		pthread_mutex_unlock(&slab_lock);
+		return NULL;
+	}
+
+	void *obj;
+	if (c->free_list) {
+		obj = c->free_list;
+		c->free_list = c->free_list->next;
+	} else {
+		// never used objects are taken in order, so pages of
+		// a fresh chunk are touched only when needed
+		obj = chunk_object(c, c->carved++);
+	}
+
+	if (++c->used == c->capacity)
+		partial_remove(c);
+	used_bytes += class_size(cls);
+
+	pthread_mutex_unlock(&slab_lock);
+	return obj;
+}
+
+void
+slab_free(void *ptr, size_t size)
+{
+	if (!ptr)
+		return;
+
+	if (size > SLAB_MAX_OBJECT) {
+		munmap(ptr, page_round(size));
+		__atomic_sub_fetch(&big_objects, 1, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&big_bytes, page_round(size), __ATOMIC_RELAXED);
+		return;
+	}
+
+	struct slab_chunk *c = (struct slab_chunk *)
+		((uintptr_t) ptr & ~(uintptr_t) (SLAB_CHUNK_SIZE - 1));
+
+	pthread_mutex_lock(&slab_lock);
+
+	bool was_full = c->used == c->capacity;
+
+	struct slab_free_obj *obj = ptr;
+	obj->next = c->free_list;
+	c->free_list = obj;
+	--c->used;
+	used_bytes -= class_size(c->cls);
+
+	if (!c->used) {
+		if (!was_full)
+			partial_remove(c);
+
+		if (spare[c->cls]) {
+			munmap(c, SLAB_CHUNK_SIZE);
+			--num_chunks;
+		} else {
+			size_t offset = first_object_offset();
+			madvise((char *) c + offset, SLAB_CHUNK_SIZE - offset, MADV_DONTNEED);
+			spare[c->cls] = c;
+		}
+	} else if (was_full) {
+		partial_push(c);
+	}
+
+	pthread_mutex_unlock(&slab_lock);
+}
+
+void
+slab_stats(struct slab_stats *stats)
+{
+	pthread_mutex_lock(&slab_lock);
+
+	stats->chunks = num_chunks;
+	stats->spare_chunks = 0;
+	for (int cls = 0; cls < SLAB_NUM_CLASSES; ++cls)
+		stats->spare_chunks += spare[cls] != NULL;
+	stats->used_bytes = used_bytes;
+
+	pthread_mutex_unlock(&slab_lock);
+
+	stats->big_objects = __atomic_load_n(&big_objects, __ATOMIC_RELAXED);
+	stats->big_bytes = __atomic_load_n(&big_bytes, __ATOMIC_RELAXED);
+}
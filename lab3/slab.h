@@ -0,0 +1,60 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+
+/**
+ * Allocator of file data for userfs. Objects of one size class
+ * (a power of two) are carved out of big chunks, SLAB_CHUNK_SIZE
+ * each and aligned to it, so an object finds its chunk by masking
+ * its address. Every chunk keeps a free list of its objects, and a
+ * chunk is given back to the OS as soon as it is empty (its pages
+ * only, for one spare chunk per class). Objects bigger than
+ * SLAB_MAX_OBJECT are mapped on their own. Both functions can be
+ * called from any thread.
+ */
+
+enum {
+	SLAB_CHUNK_SIZE = 2 * 1024 * 1024,
+	SLAB_MIN_OBJECT = 64,
+	SLAB_MAX_OBJECT = 256 * 1024,
+};
+
+/**
+ * Allocate an object.
+ * @param size Object size, it is rounded up to its size class.
+ *
+ * @retval Pointer to the object, NULL if there is no memory.
+ */
+void *
+slab_alloc(size_t size);
+
+/**
+ * Free an object.
+ * @param ptr Object from slab_alloc().
+ * @param size The same size which was passed to slab_alloc().
+ */
+void
+slab_free(void *ptr, size_t size);
+
+/** Occupancy of the allocator. */
+struct slab_stats {
+	/** Chunks mapped, the spare ones too. */
+	size_t chunks;
+	/** Empty chunks kept for reuse, without pages. */
+	size_t spare_chunks;
+	/** Bytes of the objects given out from chunks. */
+	size_t used_bytes;
+	/** Objects mapped on their own, and their bytes. */
+	size_t big_objects;
+	size_t big_bytes;
+};
+
+/**
+ * Get occupancy of the allocator.
+ * @param[out] stats Statistics.
+ */
+void
+slab_stats(struct slab_stats *stats);
+
+#endif /* SLAB_H */
@@ -0,0 +1,1288 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "userfs.h"
+#include "slab.h"
+
+/**
+ * Behaviour tests of userfs, one function per feature. Every test
+ * deletes its files, so the next one starts from an empty FS and
+ * the memory counters of ufs_stats() can be compared exactly.
+ *
+ *     make check
+ */
+
+#define CHECK(cond) do {						\
+	if (!(cond)) {							\
+		fprintf(stderr, "%s:%d: check failed: %s\n",		\
+			__FILE__, __LINE__, #cond);			\
+		exit(1);						\
+	}								\
+} while (0)
+
+enum {
+	KB = 1024,
+	MB = 1024 * 1024,
+	MAX_FILE_SIZE = 100 * MB,
+};
+
+/** Image path of the tests, unique for the process. */
+static char image[64];
+static char journal[80];
+
+static void fill(char *data, size_t size, unsigned seed) {
+	for (size_t i = 0; i < size; ++i)
+		data[i] = (char) (i * seed + i / 1000);
+}
+
+static bool is_zero(const char *data, size_t size) {
+	for (size_t i = 0; i < size; ++i) {
+		if (data[i])
+			return false;
+	}
+	return true;
+}
+
+static void write_file(const char *name, const char *data, size_t size) {
+	int fd = ufs_open(name, UFS_CREATE);
+	CHECK(fd != -1);
+	CHECK(ufs_resize(fd, 0) == 0);
+	CHECK(ufs_write(fd, data, size) == (ssize_t) size);
+	CHECK(ufs_close(fd) == 0);
+}
+
+static void check_content(const char *name, const char *data, size_t size) {
+	int fd = ufs_open(name, 0);
+	CHECK(fd != -1);
+	char *back = malloc(size + 1);
+	CHECK(ufs_read(fd, back, size + 1) == (ssize_t) size);
+	CHECK(size == 0 || memcmp(back, data, size) == 0);
+	free(back);
+	CHECK(ufs_close(fd) == 0);
+}
+
+/** Nothing is left from the test: no files, no file memory. */
+static void check_empty(void) {
+	struct ufs_stats st;
+	ufs_stats(&st);
+	CHECK(st.files == 0 && st.deleted_files == 0 && st.descriptors == 0);
+	CHECK(st.file_bytes == 0 && st.data_bytes == 0);
+}
+
+static void test_basic(void) {
+	CHECK(ufs_open("f", 0) == -1 && ufs_errno() == UFS_ERR_NO_FILE);
+	int fd = ufs_open("f", UFS_CREATE);
+	CHECK(fd != -1);
+	CHECK(ufs_write(fd, "hello", 5) == 5);
+
+	int fd2 = ufs_open("f", 0);
+	char buf[100];
+	CHECK(ufs_read(fd2, buf, sizeof(buf)) == 5 && memcmp(buf, "hello", 5) == 0);
+	CHECK(ufs_read(fd2, buf, sizeof(buf)) == 0);
+	CHECK(ufs_write(fd, " world", 6) == 6);
+	CHECK(ufs_read(fd2, buf, sizeof(buf)) == 6 && memcmp(buf, " world", 6) == 0);
+
+	CHECK(ufs_close(fd) == 0 && ufs_close(fd2) == 0);
+	CHECK(ufs_close(fd) == -1 && ufs_errno() == UFS_ERR_NO_FILE);
+	CHECK(ufs_delete("f") == 0);
+	CHECK(ufs_delete("f") == -1 && ufs_errno() == UFS_ERR_NO_FILE);
+
+	// a deleted file lives while it is open, the name is free
+	fd = ufs_open("d", UFS_CREATE);
+	CHECK(ufs_write(fd, "abc", 3) == 3);
+	CHECK(ufs_delete("d") == 0);
+	CHECK(ufs_open("d", 0) == -1);
+	fd2 = ufs_open("d", UFS_CREATE);
+	CHECK(ufs_write(fd2, "xy", 2) == 2);
+	check_content("d", "xy", 2);
+	CHECK(ufs_pread(fd, buf, sizeof(buf), 0) == 3 && memcmp(buf, "abc", 3) == 0);
+	CHECK(ufs_close(fd) == 0 && ufs_close(fd2) == 0);
+	CHECK(ufs_delete("d") == 0);
+
+	// open flags
+	fd = ufs_open("p", UFS_CREATE | UFS_READ_ONLY);
+	CHECK(ufs_write(fd, "x", 1) == -1 && ufs_errno() == UFS_ERR_NO_PERMISSION);
+	fd2 = ufs_open("p", UFS_WRITE_ONLY);
+	CHECK(ufs_read(fd2, buf, 1) == -1 && ufs_errno() == UFS_ERR_NO_PERMISSION);
+	CHECK(ufs_write(fd2, "x", 1) == 1);
+	CHECK(ufs_close(fd) == 0 && ufs_close(fd2) == 0);
+	CHECK(ufs_delete("p") == 0);
+	check_empty();
+}
+
+/** Per-file extent index: big files, overwrites, the size limit. */
+static void test_big_file(void) {
+	size_t size = 16 * MB + 123;
+	char *data = malloc(size);
+	char *back = malloc(size);
+	fill(data, size, 7);
+
+	int fd = ufs_open("big", UFS_CREATE);
+	for (size_t done = 0; done < size; ) {
+		size_t n = 1000 + done % 3000;
+		if (n > size - done)
+			n = size - done;
+		CHECK(ufs_write(fd, data + done, n) == (ssize_t) n);
+		done += n;
+	}
+
+	int rfd = ufs_open("big", 0);
+	size_t done = 0;
+	ssize_t n;
+	while ((n = ufs_read(rfd, back + done, 4 * KB)) > 0)
+		done += n;
+	CHECK(n == 0 && done == size && memcmp(data, back, size) == 0);
+
+	// an overwrite in the middle keeps the size
+	CHECK(ufs_pwrite(fd, "ZZZZ", 4, 5 * MB) == 4);
+	memcpy(data + 5 * MB, "ZZZZ", 4);
+	check_content("big", data, size);
+	CHECK(ufs_close(fd) == 0 && ufs_close(rfd) == 0);
+	CHECK(ufs_delete("big") == 0);
+
+	// the file can't grow over the max size
+	fd = ufs_open("max", UFS_CREATE);
+	CHECK(ufs_resize(fd, MAX_FILE_SIZE - 1) == 0);
+	CHECK(ufs_pwrite(fd, "a", 1, MAX_FILE_SIZE - 2) == 1);
+	CHECK(ufs_write(fd, "ab", 2) == 2);
+	CHECK(ufs_pwrite(fd, "ab", 2, MAX_FILE_SIZE - 1) == -1 && ufs_errno() == UFS_ERR_NO_MEM);
+	CHECK(ufs_resize(fd, MAX_FILE_SIZE) == -1 && ufs_errno() == UFS_ERR_NO_MEM);
+	CHECK(ufs_close(fd) == 0);
+	CHECK(ufs_delete("max") == 0);
+
+	free(data);
+	free(back);
+	check_empty();
+}
+
+/** Hash lookup of names: many files, deletes leave tombstones. */
+static void test_many_files(void) {
+	enum { COUNT = 20000 };
+	char name[32];
+
+	for (int i = 0; i < COUNT; ++i) {
+		snprintf(name, sizeof(name), "file%d", i);
+		write_file(name, name, strlen(name));
+	}
+	for (int i = 0; i < COUNT; i += 2) {
+		snprintf(name, sizeof(name), "file%d", i);
+		CHECK(ufs_delete(name) == 0);
+	}
+	for (int i = 0; i < COUNT; ++i) {
+		snprintf(name, sizeof(name), "file%d", i);
+		int fd = ufs_open(name, 0);
+		CHECK((fd != -1) == (i % 2 == 1));
+		if (fd != -1) {
+			check_content(name, name, strlen(name));
+			CHECK(ufs_close(fd) == 0);
+		}
+	}
+
+	// names come back into the places of deleted ones
+	for (int i = 0; i < COUNT; i += 2) {
+		snprintf(name, sizeof(name), "file%d", i);
+		write_file(name, "again", 5);
+	}
+	for (int i = 0; i < COUNT; ++i) {
+		snprintf(name, sizeof(name), "file%d", i);
+		if (i % 2 == 0)
+			check_content(name, "again", 5);
+		CHECK(ufs_delete(name) == 0);
+	}
+
+	// long names do not fit the name arena
+	char long_name[3000];
+	memset(long_name, 'n', sizeof(long_name) - 1);
+	long_name[sizeof(long_name) - 1] = 0;
+	write_file(long_name, "L", 1);
+	check_content(long_name, "L", 1);
+	CHECK(ufs_delete(long_name) == 0);
+	check_empty();
+}
+
+static void test_slab(void) {
+	struct slab_stats before, st;
+	slab_stats(&before);
+
+	enum { COUNT = 1000 };
+	size_t sizes[] = {1, 64, 100, 4 * KB, 100 * KB, SLAB_MAX_OBJECT, SLAB_MAX_OBJECT + 1};
+	int num_sizes = sizeof(sizes) / sizeof(sizes[0]);
+	static char *objects[COUNT];
+
+	size_t big = 0;
+	for (int i = 0; i < COUNT; ++i) {
+		size_t size = sizes[i % num_sizes];
+		objects[i] = slab_alloc(size);
+		CHECK(objects[i] != NULL);
+		memset(objects[i], i, size);
+		big += size > SLAB_MAX_OBJECT;
+	}
+	slab_stats(&st);
+	CHECK(st.used_bytes > before.used_bytes);
+	CHECK(st.big_objects == before.big_objects + big);
+
+	// objects do not overlap
+	for (int i = 0; i < COUNT; ++i) {
+		size_t size = sizes[i % num_sizes];
+		CHECK(objects[i][0] == (char) i && objects[i][size - 1] == (char) i);
+	}
+
+	for (int i = 0; i < COUNT; ++i)
+		slab_free(objects[i], sizes[i % num_sizes]);
+	slab_stats(&st);
+	CHECK(st.used_bytes == before.used_bytes);
+	CHECK(st.big_objects == before.big_objects && st.big_bytes == before.big_bytes);
+	// empty chunks are given back, one spare per class at most
+	CHECK(st.chunks - st.spare_chunks <= before.chunks - before.spare_chunks);
+}
+
+/** Geometric extents of every block size, across resizes. */
+static void test_block_sizes(void) {
+	size_t sizes[] = {1, 64, 100, 4 * KB, MB, 4 * MB};
+	size_t size = 5 * MB + 123;
+	char *data = malloc(size);
+	char *back = malloc(size);
+	fill(data, size, 31);
+
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+		ufs_set_block_size(sizes[s]);
+		int fd = ufs_open("bs", UFS_CREATE);
+		for (size_t done = 0; done < size; ) {
+			size_t n = 1 + (done * 13) % 300000;
+			if (n > size - done)
+				n = size - done;
+			CHECK(ufs_write(fd, data + done, n) == (ssize_t) n);
+			done += n;
+		}
+		check_content("bs", data, size);
+
+		CHECK(ufs_resize(fd, 777777) == 0);
+		CHECK(ufs_resize(fd, 1000000) == 0);
+		int rfd = ufs_open("bs", 0);
+		CHECK(ufs_read(rfd, back, size) == 1000000);
+		CHECK(memcmp(data, back, 777777) == 0);
+		CHECK(is_zero(back + 777777, 1000000 - 777777));
+		CHECK(ufs_close(rfd) == 0 && ufs_close(fd) == 0);
+		CHECK(ufs_delete("bs") == 0);
+	}
+
+	ufs_set_block_size(512);
+	free(data);
+	free(back);
+	check_empty();
+}
+
+/** Descriptor cursors stay right when another one resizes. */
+static void test_resize(void) {
+	char buf[4 * KB];
+	memset(buf, 'a', sizeof(buf));
+	int fd = ufs_open("r", UFS_CREATE);
+	CHECK(ufs_write(fd, buf, 3000) == 3000);
+
+	int fd2 = ufs_open("r", 0);
+	CHECK(ufs_read(fd2, buf, 2500) == 2500);
+	CHECK(ufs_resize(fd, 100) == 0);
+	// the cut descriptor goes on from the new end
+	CHECK(ufs_read(fd2, buf, 10) == 0);
+	CHECK(ufs_write(fd2, "b", 1) == 1);
+	CHECK(ufs_close(fd2) == 0);
+
+	CHECK(ufs_resize(fd, 2000) == 0);
+	fd2 = ufs_open("r", 0);
+	CHECK(ufs_read(fd2, buf, sizeof(buf)) == 2000);
+	CHECK(buf[0] == 'a' && buf[99] == 'a' && buf[100] == 'b');
+	CHECK(is_zero(buf + 101, 2000 - 101));
+
+	CHECK(ufs_resize(fd, 0) == 0);
+	CHECK(ufs_read(fd2, buf, 10) == 0);
+	CHECK(ufs_resize(fd, 513) == 0);
+	CHECK(ufs_pread(fd2, buf, sizeof(buf), 0) == 513 && is_zero(buf, 513));
+
+	// a sequential reader steps extents while a writer appends
+	CHECK(ufs_resize(fd, 0) == 0);
+	char *data = malloc(MB);
+	fill(data, MB, 3);
+	int rfd = ufs_open("r", 0);
+	size_t got = 0;
+	for (size_t done = 0; done < MB; done += 10 * KB) {
+		CHECK(ufs_write(fd, data + done, done + 10 * KB < MB ? 10 * KB : MB - done) > 0);
+		ssize_t n;
+		while ((n = ufs_read(rfd, buf, 3000)) > 0) {
+			CHECK(memcmp(buf, data + got, n) == 0);
+			got += n;
+		}
+	}
+	CHECK(got == MB);
+	free(data);
+
+	CHECK(ufs_close(rfd) == 0 && ufs_close(fd2) == 0 && ufs_close(fd) == 0);
+	CHECK(ufs_delete("r") == 0);
+	check_empty();
+}
+
+static void test_positional(void) {
+	char buf[100];
+	int fd = ufs_open("p", UFS_CREATE);
+	CHECK(ufs_pwrite(fd, "xyz", 3, 10) == 3);
+	CHECK(ufs_read(fd, buf, sizeof(buf)) == 13);
+	CHECK(is_zero(buf, 10) && memcmp(buf + 10, "xyz", 3) == 0);
+	CHECK(ufs_pread(fd, buf, sizeof(buf), 11) == 2 && memcmp(buf, "yz", 2) == 0);
+	CHECK(ufs_pread(fd, buf, sizeof(buf), 13) == 0);
+	CHECK(ufs_pread(fd, buf, sizeof(buf), 1000) == 0);
+
+	// nothing to write does not grow the file
+	CHECK(ufs_pwrite(fd, "", 0, 5000) == 0);
+	CHECK(ufs_size(fd) == 13);
+
+	// the descriptor position is not moved by pread/pwrite
+	CHECK(ufs_write(fd, "END", 3) == 3);
+	CHECK(ufs_pwrite(fd, "Q", 1, 0) == 1);
+	struct iovec iov[3] = {{"aa", 2}, {"", 0}, {"bbb", 3}};
+	CHECK(ufs_writev(fd, iov, 3) == 5);
+
+	char head[4], tail[20];
+	struct iovec rd[2] = {{head, sizeof(head)}, {tail, sizeof(tail)}};
+	int fd2 = ufs_open("p", 0);
+	CHECK(ufs_readv(fd2, rd, 2) == 21);
+	CHECK(memcmp(head, "Q\0\0\0", 4) == 0 && memcmp(tail + 6, "xyzENDaabbb", 11) == 0);
+	CHECK(ufs_readv(fd2, rd, 2) == 0);
+
+	// across extents
+	size_t size = 3 * MB;
+	char *data = malloc(size);
+	char *back = malloc(size);
+	fill(data, size, 251);
+	CHECK(ufs_pwrite(fd, data, size, 12345) == (ssize_t) size);
+	CHECK(ufs_pread(fd2, back, size, 12345) == (ssize_t) size);
+	CHECK(memcmp(data, back, size) == 0);
+	CHECK(ufs_pwrite(fd, "x", 1, 200 * MB) == -1 && ufs_errno() == UFS_ERR_NO_MEM);
+	CHECK(ufs_size(fd) == 12345 + (ssize_t) size);
+	free(data);
+	free(back);
+
+	CHECK(ufs_size(-1) == -1 && ufs_errno() == UFS_ERR_NO_FILE);
+	CHECK(ufs_close(fd) == 0 && ufs_close(fd2) == 0);
+	CHECK(ufs_delete("p") == 0);
+	check_empty();
+}
+
+static void test_borrow(void) {
+	size_t size = 2 * MB;
+	char *data = malloc(size);
+	fill(data, size, 253);
+	int fd = ufs_open("b", UFS_CREATE);
+	CHECK(ufs_write(fd, data, size) == (ssize_t) size);
+
+	int rfd = ufs_open("b", 0);
+	struct iovec iov[64];
+	int cnt = 64;
+	CHECK(ufs_read_borrow(rfd, size, iov, &cnt) == (ssize_t) size);
+	CHECK(cnt > 1);
+
+	// borrowed memory stays valid when the file is cut
+	CHECK(ufs_resize(fd, 100) == 0);
+	size_t offset = 0;
+	for (int i = 0; i < cnt; ++i) {
+		CHECK(memcmp(iov[i].iov_base, data + offset, iov[i].iov_len) == 0);
+		offset += iov[i].iov_len;
+	}
+	CHECK(offset == size);
+
+	// the kept extents read as zeros when the file grows back
+	CHECK(ufs_resize(fd, 5000) == 0);
+	char buf[5000];
+	CHECK(ufs_pread(fd, buf, sizeof(buf), 0) == 5000);
+	CHECK(memcmp(buf, data, 100) == 0 && is_zero(buf + 100, 4900));
+	CHECK(ufs_read_release(rfd) == 0);
+	CHECK(ufs_read_release(rfd) == 0);
+
+	// the count limits the pieces
+	CHECK(ufs_close(rfd) == 0);
+	rfd = ufs_open("b", 0);
+	cnt = 1;
+	CHECK(ufs_read_borrow(rfd, 10000, iov, &cnt) == 512 && cnt == 1);
+	cnt = 0;
+	CHECK(ufs_read_borrow(rfd, 10000, iov, &cnt) == 0);
+
+	// a deleted file is freed on the close of the borrower
+	CHECK(ufs_delete("b") == 0);
+	CHECK(ufs_close(fd) == 0);
+	CHECK(memcmp(iov[0].iov_base, data, 100) == 0);
+	CHECK(ufs_close(rfd) == 0);
+
+	fd = ufs_open("w", UFS_CREATE | UFS_WRITE_ONLY);
+	cnt = 1;
+	CHECK(ufs_read_borrow(fd, 1, iov, &cnt) == -1 && ufs_errno() == UFS_ERR_NO_PERMISSION);
+	CHECK(ufs_close(fd) == 0);
+	CHECK(ufs_delete("w") == 0);
+
+	free(data);
+	check_empty();
+}
+
+static void test_clone(void) {
+	size_t size = 3 * MB;
+	char *a = malloc(size);
+	char *b = malloc(size);
+	fill(a, size, 241);
+	int fd = ufs_open("base", UFS_CREATE);
+	CHECK(ufs_write(fd, a, size) == (ssize_t) size);
+
+	CHECK(ufs_clone("nope", "x") == -1 && ufs_errno() == UFS_ERR_NO_FILE);
+	CHECK(ufs_clone("base", "copy") == 0);
+	// a clone over an existing file replaces it
+	CHECK(ufs_clone("base", "copy") == 0);
+	check_content("copy", a, size);
+
+	struct ufs_stats st;
+	ufs_stats(&st);
+	CHECK(st.shared_extents > 0 && st.data_bytes < 2 * size);
+
+	// the source and the clone do not see writes of each other
+	memcpy(b, a, size);
+	CHECK(ufs_pwrite(fd, "SRC", 3, 1000) == 3);
+	memcpy(b + 1000, "SRC", 3);
+	check_content("base", b, size);
+	check_content("copy", a, size);
+
+	int cfd = ufs_open("copy", 0);
+	char buf[10];
+	// the cursor is on a shared extent before the write
+	CHECK(ufs_read(cfd, buf, 10) == 10);
+	CHECK(ufs_pwrite(cfd, "CPY", 3, 2 * MB) == 3);
+	CHECK(ufs_write(cfd, "Q", 1) == 1);
+	CHECK(ufs_read(cfd, buf, 1) == 1 && buf[0] == a[11]);
+	CHECK(ufs_resize(cfd, 1500) == 0);
+	CHECK(ufs_resize(cfd, 4000) == 0);
+	check_content("base", b, size);
+	CHECK(ufs_close(cfd) == 0);
+
+	// snapshots
+	int s1 = ufs_snapshot_create();
+	CHECK(s1 >= 0);
+	CHECK(ufs_delete("copy") == 0);
+	CHECK(ufs_resize(fd, 10) == 0);
+	write_file("new", "n", 1);
+	CHECK(ufs_snapshot_restore(s1) == 0);
+	CHECK(ufs_open("new", 0) == -1);
+	check_content("base", b, size);
+	// the old descriptor keeps the replaced file
+	CHECK(ufs_pread(fd, buf, sizeof(buf), 0) == 10);
+	CHECK(ufs_snapshot_restore(s1) == 0);
+	check_content("base", b, size);
+
+	int s2 = ufs_snapshot_create();
+	CHECK(s2 != s1);
+	CHECK(ufs_snapshot_delete(s1) == 0);
+	CHECK(ufs_snapshot_delete(s1) == -1 && ufs_errno() == UFS_ERR_NO_FILE);
+	CHECK(ufs_snapshot_restore(s1) == -1 && ufs_errno() == UFS_ERR_NO_FILE);
+	CHECK(ufs_snapshot_delete(s2) == 0);
+	check_content("base", b, size);
+	CHECK(ufs_close(fd) == 0);
+
+	// a write under a borrow copies the shared extent, and the
+	// old one is dropped on the release
+	CHECK(ufs_delete("copy") == 0);
+	CHECK(ufs_clone("base", "c2") == 0);
+	ufs_stats(&st);
+	size_t shared = st.data_bytes;
+	fd = ufs_open("c2", 0);
+	struct iovec iov[4];
+	int cnt = 4;
+	CHECK(ufs_read_borrow(fd, 100, iov, &cnt) == 100);
+	CHECK(ufs_pwrite(fd, "W", 1, 0) == 1);
+	CHECK(ufs_delete("base") == 0);
+	CHECK(((char *) iov[0].iov_base)[0] == b[0]);
+	CHECK(ufs_read_release(fd) == 0);
+	ufs_stats(&st);
+	CHECK(st.data_bytes == shared);
+	CHECK(ufs_close(fd) == 0);
+	CHECK(ufs_delete("c2") == 0);
+
+	free(a);
+	free(b);
+	check_empty();
+}
+
+static void test_persist(void) {
+	unlink(image);
+	unlink(journal);
+	CHECK(ufs_load(image) == -1 && ufs_errno() == UFS_ERR_NO_FILE);
+
+	size_t size = 5 * MB;
+	char *a = malloc(size);
+	fill(a, size, 239);
+	write_file("one", a, size);
+	write_file("two", "hello", 5);
+	write_file("empty", "", 0);
+	ufs_set_block_size(4 * KB);
+	write_file("bs", a, 10000);
+	ufs_set_block_size(512);
+	CHECK(ufs_save(image) == 0);
+
+	int keep = ufs_open("two", 0);
+	CHECK(ufs_delete("one") == 0);
+	write_file("three", "x", 1);
+	CHECK(ufs_load(image) == 0);
+	CHECK(ufs_open("three", 0) == -1);
+	check_content("one", a, size);
+	check_content("two", "hello", 5);
+	check_content("empty", "", 0);
+	check_content("bs", a, 10000);
+	// descriptors keep the files replaced by the load
+	char buf[8];
+	CHECK(ufs_read(keep, buf, sizeof(buf)) == 5);
+	CHECK(ufs_close(keep) == 0);
+
+	// a write over the data read from the image
+	int fd = ufs_open("one", 0);
+	CHECK(ufs_pwrite(fd, "MAPPED", 6, 3 * MB) == 6);
+	memcpy(a + 3 * MB, "MAPPED", 6);
+	CHECK(ufs_close(fd) == 0);
+	check_content("one", a, size);
+
+	// every kind of record of the journal
+	CHECK(ufs_clone("one", "copy") == 0);
+	char *copy = malloc(size);
+	memcpy(copy, a, size);
+	CHECK(ufs_journal_start(image) == 0);
+	write_file("j1", "journal", 7);
+	fd = ufs_open("one", 0);
+	CHECK(ufs_pwrite(fd, "JJ", 2, 100) == 2);
+	memcpy(a + 100, "JJ", 2);
+	struct iovec iov[2] = {{"ab", 2}, {"cd", 2}};
+	CHECK(ufs_writev(fd, iov, 2) == 4);
+	memcpy(a, "abcd", 4);
+	CHECK(ufs_resize(fd, size - 10) == 0);
+	CHECK(ufs_close(fd) == 0);
+	CHECK(ufs_delete("two") == 0);
+	write_file("two", "again", 5);
+	CHECK(ufs_clone("j1", "j2") == 0);
+	CHECK(ufs_delete("empty") == 0);
+	// a deleted file is not in the image, its writes are not
+	// replayed
+	int stale = ufs_open("j2", 0);
+	CHECK(ufs_delete("j2") == 0);
+	CHECK(ufs_write(stale, "zzz", 3) == 3);
+	CHECK(ufs_close(stale) == 0);
+	CHECK(ufs_clone("j1", "j2") == 0);
+	ufs_journal_stop();
+
+	// replay stops at a torn record
+	int jfd = open(journal, O_WRONLY | O_APPEND);
+	CHECK(jfd != -1);
+	CHECK(write(jfd, "torn-tail-xxxxxxxxxxxxxxxxxxxxxxxxxxxxxx", 40) == 40);
+	close(jfd);
+
+	write_file("junk", "j", 1);
+	CHECK(ufs_load(image) == 0);
+	CHECK(ufs_open("junk", 0) == -1 && ufs_open("empty", 0) == -1);
+	check_content("one", a, size - 10);
+	check_content("two", "again", 5);
+	check_content("j1", "journal", 7);
+	check_content("j2", "journal", 7);
+	check_content("copy", copy, size);
+
+	// a save empties the journal even when it is off, or its old
+	// records would be replayed over the new image
+	fd = ufs_open("two", 0);
+	CHECK(ufs_journal_start(image) == 0);
+	CHECK(ufs_pwrite(fd, "JOURNALED", 9, 0) == 9);
+	ufs_journal_stop();
+	CHECK(ufs_resize(fd, 0) == 0);
+	CHECK(ufs_pwrite(fd, "new", 3, 0) == 3);
+	CHECK(ufs_close(fd) == 0);
+	CHECK(ufs_save(image) == 0);
+	CHECK(ufs_load(image) == 0);
+	check_content("two", "new", 3);
+
+	// new files do not take numbers of journaled ones
+	write_file("after", "new", 3);
+	CHECK(ufs_save(image) == 0);
+	CHECK(ufs_load(image) == 0);
+	check_content("after", "new", 3);
+	check_content("j2", "journal", 7);
+
+	// a broken image leaves the files alone
+	int bfd = open(image, O_WRONLY);
+	CHECK(write(bfd, "XXXX", 4) == 4);
+	close(bfd);
+	CHECK(ufs_load(image) == -1 && ufs_errno() == UFS_ERR_IO);
+	check_content("after", "new", 3);
+
+	const char *names[] = {"one", "two", "j1", "j2", "copy", "bs", "after"};
+	for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i)
+		CHECK(ufs_delete(names[i]) == 0);
+	unlink(image);
+	unlink(journal);
+	free(a);
+	free(copy);
+	check_empty();
+}
+
+static void test_sparse(void) {
+	size_t size = 99 * MB;
+	int fd = ufs_open("sp", UFS_CREATE);
+
+	// a resize makes holes only
+	struct ufs_stats st;
+	CHECK(ufs_resize(fd, size) == 0);
+	ufs_stats(&st);
+	CHECK(st.data_bytes == 0 && st.holes > 0);
+	CHECK(ufs_resize(fd, 0) == 0);
+
+	CHECK(ufs_write(fd, "head", 4) == 4);
+	CHECK(ufs_resize(fd, size) == 0);
+	CHECK(ufs_pwrite(fd, "mid", 3, 50 * MB) == 3);
+	CHECK(ufs_pwrite(fd, "end", 3, size - 3) == 3);
+	ufs_stats(&st);
+	CHECK(st.data_bytes < 4 * MB);
+
+	char *buf = malloc(size);
+	int rfd = ufs_open("sp", 0);
+	CHECK(ufs_read(rfd, buf, size) == (ssize_t) size);
+	CHECK(memcmp(buf, "head", 4) == 0 && is_zero(buf + 4, 50 * MB - 4));
+	CHECK(memcmp(buf + 50 * MB, "mid", 3) == 0);
+	CHECK(is_zero(buf + 50 * MB + 3, size - 50 * MB - 6));
+	CHECK(memcmp(buf + size - 3, "end", 3) == 0);
+	CHECK(ufs_close(rfd) == 0);
+
+	// a borrowed hole reads as zeros
+	rfd = ufs_open("sp", 0);
+	struct iovec iov[4];
+	int cnt = 4;
+	CHECK(ufs_read(rfd, buf, 8) == 8);
+	CHECK(ufs_read_borrow(rfd, 1000, iov, &cnt) == 1000);
+	for (int i = 0; i < cnt; ++i)
+		CHECK(is_zero(iov[i].iov_base, iov[i].iov_len));
+	CHECK(ufs_read_release(rfd) == 0);
+
+	// a hole passed by a cursor is filled through another
+	// descriptor
+	int r2 = ufs_open("sp", 0);
+	char part[4 * KB];
+	for (size_t offset = 0; offset < 30 * MB; )
+		offset += ufs_read(r2, part, sizeof(part));
+	CHECK(ufs_pwrite(fd, "FILL", 4, 30 * MB + 10) == 4);
+	CHECK(ufs_read(r2, part, 20) == 20 && memcmp(part + 10, "FILL", 4) == 0);
+	CHECK(ufs_close(r2) == 0);
+
+	// a cut into a written extent and a grow back
+	CHECK(ufs_resize(fd, 2) == 0);
+	CHECK(ufs_resize(fd, 10000) == 0);
+	CHECK(ufs_pread(rfd, buf, 20000, 0) == 10000);
+	CHECK(buf[0] == 'h' && buf[1] == 'e' && is_zero(buf + 2, 10000 - 2));
+
+	// clones and images keep the holes
+	CHECK(ufs_resize(fd, 20 * MB) == 0);
+	CHECK(ufs_pwrite(fd, "X", 1, 15 * MB) == 1);
+	CHECK(ufs_clone("sp", "sp2") == 0);
+	CHECK(ufs_save(image) == 0);
+	CHECK(ufs_load(image) == 0);
+	int c = ufs_open("sp2", 0);
+	CHECK(ufs_read(c, buf, size) == 20 * MB);
+	CHECK(buf[0] == 'h' && buf[15 * MB] == 'X');
+	CHECK(is_zero(buf + 2, 15 * MB - 2) && is_zero(buf + 15 * MB + 1, 5 * MB - 1));
+	CHECK(ufs_close(c) == 0);
+	unlink(image);
+
+	CHECK(ufs_close(fd) == 0 && ufs_close(rfd) == 0);
+	CHECK(ufs_delete("sp") == 0 && ufs_delete("sp2") == 0);
+	free(buf);
+	check_empty();
+}
+
+static void test_descriptors(void) {
+	enum { COUNT = 10000 };
+	static int fds[COUNT];
+	int base = ufs_open("fds", UFS_CREATE);
+	for (int i = 0; i < COUNT; ++i) {
+		fds[i] = ufs_open("fds", 0);
+		CHECK(fds[i] != -1);
+	}
+	for (int r = 0; r < 100000; ++r) {
+		int i = (int) ((long) r * 7919 % COUNT);
+		CHECK(ufs_close(fds[i]) == 0);
+		fds[i] = ufs_open("fds", 0);
+		CHECK(fds[i] != -1);
+	}
+
+	// the lowest free descriptor is taken
+	CHECK(ufs_close(fds[5]) == 0);
+	int again = ufs_open("fds", 0);
+	CHECK(again == fds[5]);
+	fds[5] = again;
+
+	struct ufs_stats st;
+	ufs_stats(&st);
+	CHECK(st.descriptors == COUNT + 1);
+	for (int i = 0; i < COUNT; ++i)
+		CHECK(ufs_close(fds[i]) == 0);
+	CHECK(ufs_close(fds[3]) == -1 && ufs_errno() == UFS_ERR_NO_FILE);
+	CHECK(ufs_close(1 << 20) == -1 && ufs_close(-1) == -1);
+	CHECK(ufs_close(base) == 0);
+
+	// the table shrank, new descriptors are small again
+	int fd = ufs_open("fds", 0);
+	CHECK(fd < 64);
+	CHECK(ufs_close(fd) == 0);
+	CHECK(ufs_delete("fds") == 0);
+	check_empty();
+}
+
+static void test_inline(void) {
+	char name[32], data[32];
+	for (int i = 0; i < 10000; ++i) {
+		snprintf(name, sizeof(name), "tiny_%d", i);
+		int len = snprintf(data, sizeof(data), "v%d", i);
+		write_file(name, data, len);
+	}
+	struct ufs_stats st;
+	ufs_stats(&st);
+	CHECK(st.inline_files == 10000 && st.data_bytes == 0);
+	for (int i = 0; i < 10000; ++i) {
+		snprintf(name, sizeof(name), "tiny_%d", i);
+		int len = snprintf(data, sizeof(data), "v%d", i);
+		check_content(name, data, len);
+		CHECK(ufs_delete(name) == 0);
+	}
+
+	// a cut and a grow inside the record zero the tail
+	int fd = ufs_open("t", UFS_CREATE);
+	CHECK(ufs_write(fd, "abcdefghij", 10) == 10);
+	CHECK(ufs_resize(fd, 3) == 0);
+	CHECK(ufs_resize(fd, 8) == 0);
+	check_content("t", "abc\0\0\0\0\0", 8);
+	CHECK(ufs_pwrite(fd, "Z", 1, 20) == 1);
+	char expected[100] = "abc";
+	expected[20] = 'Z';
+	check_content("t", expected, 21);
+
+	// a write over the limit moves the data to an extent
+	CHECK(ufs_pwrite(fd, "0123456789", 10, 60) == 10);
+	memcpy(expected + 60, "0123456789", 10);
+	check_content("t", expected, 70);
+	ufs_stats(&st);
+	CHECK(st.inline_files == 0);
+	CHECK(ufs_resize(fd, 2) == 0);
+	check_content("t", "ab", 2);
+
+	// borrowed inline data survives a cut
+	CHECK(ufs_resize(fd, 0) == 0);
+	CHECK(ufs_close(fd) == 0);
+	CHECK(ufs_delete("t") == 0);
+	write_file("t", "hello", 5);
+	int rfd = ufs_open("t", 0);
+	struct iovec iov[4];
+	int cnt = 4;
+	CHECK(ufs_read_borrow(rfd, 100, iov, &cnt) == 5 && cnt == 1);
+	fd = ufs_open("t", 0);
+	CHECK(ufs_resize(fd, 1) == 0);
+	CHECK(memcmp(iov[0].iov_base, "hello", 5) == 0);
+	CHECK(ufs_resize(fd, 1000) == 0);
+	CHECK(ufs_read_release(rfd) == 0);
+	CHECK(ufs_close(rfd) == 0 && ufs_close(fd) == 0);
+
+	// clones of inline files are apart
+	write_file("t2", "tiny", 4);
+	CHECK(ufs_clone("t2", "t3") == 0);
+	fd = ufs_open("t2", 0);
+	CHECK(ufs_pwrite(fd, "X", 1, 0) == 1);
+	CHECK(ufs_close(fd) == 0);
+	check_content("t2", "Xiny", 4);
+	check_content("t3", "tiny", 4);
+
+	// an image keeps them
+	CHECK(ufs_save(image) == 0);
+	CHECK(ufs_delete("t2") == 0);
+	CHECK(ufs_load(image) == 0);
+	check_content("t2", "Xiny", 4);
+	check_content("t3", "tiny", 4);
+	unlink(image);
+
+	CHECK(ufs_delete("t") == 0 && ufs_delete("t2") == 0 && ufs_delete("t3") == 0);
+	check_empty();
+}
+
+static void test_stats(void) {
+	struct ufs_stats st;
+	ufs_stats(&st);
+	uint64_t opens = st.ops[UFS_OP_OPEN].count;
+
+	size_t size = 3 * MB;
+	char *data = malloc(size);
+	memset(data, 7, size);
+	write_file("s1", data, size);
+	write_file("s2", "tiny", 4);
+	int fd = ufs_open("s3", UFS_CREATE);
+	CHECK(ufs_pwrite(fd, "x", 1, 2 * MB) == 1);
+	int keep = ufs_open("s1", 0);
+	CHECK(ufs_delete("s1") == 0);
+
+	ufs_stats(&st);
+	CHECK(st.files == 2 && st.deleted_files == 1 && st.descriptors == 2);
+	CHECK(st.inline_files == 1);
+	CHECK(st.file_bytes == 4 + 2 * MB + 1);
+	CHECK(st.holes > 0 && st.extents >= 1);
+	CHECK(st.data_bytes >= size);
+	CHECK(st.ops[UFS_OP_OPEN].count == opens + 4);
+	CHECK(st.ops[UFS_OP_WRITE].count > 0 && st.ops[UFS_OP_WRITE].max_ns > 0);
+	CHECK(st.slab_used_bytes <= st.slab_chunk_bytes);
+	CHECK(ufs_close(keep) == 0);
+	ufs_stats(&st);
+	CHECK(st.deleted_files == 0 && st.data_bytes < size);
+
+	// the limit fails writes, not resizes to holes
+	ufs_set_memory_limit(st.data_bytes + MB);
+	ufs_stats(&st);
+	CHECK(st.memory_limit == st.data_bytes + MB);
+	int w = ufs_open("big", UFS_CREATE);
+	CHECK(ufs_write(w, data, size) == -1 && ufs_errno() == UFS_ERR_NO_MEM);
+	ufs_stats(&st);
+	CHECK(st.data_bytes <= st.memory_limit);
+	CHECK(ufs_resize(w, 50 * MB) == 0);
+	CHECK(ufs_pwrite(w, "q", 1, 40 * MB) == -1 && ufs_errno() == UFS_ERR_NO_MEM);
+
+	// a failed write behind the end does not grow the file
+	CHECK(ufs_resize(w, 0) == 0);
+	ufs_stats(&st);
+	ufs_set_memory_limit(st.data_bytes + 1);
+	CHECK(ufs_pwrite(w, "q", 1, 40 * MB) == -1 && ufs_errno() == UFS_ERR_NO_MEM);
+	CHECK(ufs_size(w) == 0);
+
+	ufs_set_memory_limit(0);
+	CHECK(ufs_pwrite(w, "q", 1, 40 * MB) == 1);
+	CHECK(ufs_close(w) == 0 && ufs_close(fd) == 0);
+	CHECK(ufs_delete("big") == 0 && ufs_delete("s2") == 0 && ufs_delete("s3") == 0);
+	free(data);
+	check_empty();
+}
+
+static void test_compress(void) {
+	size_t size = 6 * MB;
+	char *a = malloc(size);
+	char *b = malloc(size);
+	size_t pos = 0;
+	for (int line = 0; pos < size - 200; ++line) {
+		pos += snprintf(a + pos, size - pos,
+				"12:%02d:%02d INFO [w-%d] id=%d path=/api/items/%d status=200\n",
+				line / 60 % 60, line % 60, line % 8, 100000 + line, line * 7 % 5000);
+	}
+	memset(a + pos, 'x', size - pos);
+	write_file("log", a, size);
+	char *r = malloc(MB);
+	srand(1);
+	for (int i = 0; i < MB; ++i)
+		r[i] = (char) rand();
+	write_file("random", r, MB);
+
+	struct ufs_stats st;
+	ufs_stats(&st);
+	size_t before = st.data_bytes;
+
+	// off by default
+	CHECK(ufs_compress_tick() == 0);
+	ufs_set_compression(3);
+	// data written a tick ago is not cold yet
+	CHECK(ufs_compress_tick() == 0);
+	int hot = ufs_open("log", 0);
+	char buf[100];
+	CHECK(ufs_pread(hot, buf, sizeof(buf), 0) == 100);
+	CHECK(ufs_compress_tick() > 0);
+
+	// the extent just read stays as is
+	ufs_stats(&st);
+	size_t packed = st.packed_extents;
+	CHECK(ufs_pread(hot, buf, sizeof(buf), 0) == 100);
+	ufs_stats(&st);
+	CHECK(st.packed_extents == packed);
+	CHECK(st.data_bytes < before && st.packed_bytes > 0);
+	check_content("log", a, size);
+	check_content("random", r, MB);
+
+	// a cursor goes over packed extents
+	for (int i = 0; i < 3; ++i)
+		ufs_compress_tick();
+	CHECK(ufs_read(hot, b, 1000) == 1000);
+	for (int i = 0; i < 3; ++i)
+		ufs_compress_tick();
+	CHECK(ufs_read(hot, b + 1000, size) == (ssize_t) size - 1000);
+	CHECK(memcmp(a, b, size) == 0);
+
+	// writes, cuts and grows of packed data
+	for (int i = 0; i < 3; ++i)
+		ufs_compress_tick();
+	CHECK(ufs_pwrite(hot, "HELLO", 5, 3 * MB) == 5);
+	memcpy(a + 3 * MB, "HELLO", 5);
+	for (int i = 0; i < 3; ++i)
+		ufs_compress_tick();
+	int w = ufs_open("log", 0);
+	CHECK(ufs_resize(w, size - 100000) == 0);
+	for (int i = 0; i < 3; ++i)
+		ufs_compress_tick();
+	CHECK(ufs_resize(w, size) == 0);
+	memset(a + size - 100000, 0, 100000);
+	check_content("log", a, size);
+
+	// a borrow of packed data, it is not packed while borrowed
+	for (int i = 0; i < 3; ++i)
+		ufs_compress_tick();
+	int bd = ufs_open("log", 0);
+	struct iovec iov[8];
+	int cnt = 8;
+	CHECK(ufs_read_borrow(bd, 5000, iov, &cnt) == 5000);
+	for (int i = 0; i < 3; ++i)
+		ufs_compress_tick();
+	CHECK(memcmp(iov[0].iov_base, a, iov[0].iov_len) == 0);
+	CHECK(ufs_read_release(bd) == 0);
+	CHECK(ufs_close(bd) == 0);
+
+	// clones, snapshots and images of packed data
+	for (int i = 0; i < 3; ++i)
+		ufs_compress_tick();
+	CHECK(ufs_clone("log", "log2") == 0);
+	int snap = ufs_snapshot_create();
+	CHECK(ufs_pwrite(w, "ZZ", 2, 10) == 2);
+	check_content("log2", a, size);
+	memcpy(a + 10, "ZZ", 2);
+	for (int i = 0; i < 3; ++i)
+		ufs_compress_tick();
+	CHECK(ufs_save(image) == 0);
+	CHECK(ufs_load(image) == 0);
+	check_content("log", a, size);
+	unlink(image);
+	CHECK(ufs_snapshot_delete(snap) == 0);
+
+	CHECK(ufs_close(hot) == 0 && ufs_close(w) == 0);
+	ufs_set_compression(0);
+	CHECK(ufs_delete("log") == 0 && ufs_delete("log2") == 0);
+	CHECK(ufs_delete("random") == 0);
+	ufs_stats(&st);
+	CHECK(st.packed_bytes == 0);
+	free(a);
+	free(b);
+	free(r);
+	check_empty();
+}
+
+/**
+ * Random operations checked against a model of the files, with
+ * images, the journal, compression and a memory limit in the mix.
+ * Files in memory must always match the model, and a load must
+ * give the files as of the last save plus what was journaled
+ * since.
+ */
+enum {
+	MODEL_FILES = 6,
+	MODEL_MAX_OFFSET = 300 * KB,
+	MODEL_STEPS = 4000,
+};
+
+struct model_file {
+	bool exists;
+	char *data;
+	size_t size;
+};
+
+struct model {
+	struct model_file files[MODEL_FILES];
+};
+
+static void model_name(int i, char *name) {
+	sprintf(name, "m%d", i);
+}
+
+static void model_copy(struct model *dst, const struct model *src) {
+	for (int i = 0; i < MODEL_FILES; ++i) {
+		free(dst->files[i].data);
+		dst->files[i] = src->files[i];
+		dst->files[i].data = malloc(src->files[i].size + 1);
+		if (src->files[i].size)
+			memcpy(dst->files[i].data, src->files[i].data, src->files[i].size);
+	}
+}
+
+static void model_free(struct model *m) {
+	for (int i = 0; i < MODEL_FILES; ++i)
+		free(m->files[i].data);
+}
+
+static void model_resize(struct model_file *f, size_t size) {
+	f->data = realloc(f->data, size + 1);
+	if (size > f->size)
+		memset(f->data + f->size, 0, size - f->size);
+	f->size = size;
+}
+
+/** Takes the file content as the userfs has it. */
+static void model_sync(struct model_file *f, const char *name) {
+	int fd = ufs_open(name, 0);
+	CHECK(fd != -1);
+	ssize_t size = ufs_size(fd);
+	CHECK(size >= 0);
+	model_resize(f, size);
+	CHECK(ufs_pread(fd, f->data, size, 0) == size);
+	CHECK(ufs_close(fd) == 0);
+}
+
+static void model_check(const struct model *m) {
+	char name[8];
+	for (int i = 0; i < MODEL_FILES; ++i) {
+		model_name(i, name);
+		if (!m->files[i].exists) {
+			CHECK(ufs_open(name, 0) == -1 && ufs_errno() == UFS_ERR_NO_FILE);
+			continue;
+		}
+		check_content(name, m->files[i].data, m->files[i].size);
+	}
+}
+
+static void test_model(void) {
+	struct model mem = {0}, disk = {0};
+	bool journal_on = false;
+	char *buf = malloc(MODEL_MAX_OFFSET);
+	char name[8], other[8];
+	srand(42);
+
+	unlink(image);
+	unlink(journal);
+	CHECK(ufs_save(image) == 0);
+
+	for (int step = 0; step < MODEL_STEPS; ++step) {
+		int i = rand() % MODEL_FILES;
+		struct model_file *f = &mem.files[i];
+		model_name(i, name);
+
+		int op = rand() % 16;
+		if (op < 5) {
+			// a write of any size at any offset, a gap too
+			size_t offset = rand() % MODEL_MAX_OFFSET;
+			size_t size = rand() % 4 == 0 ? 0 : rand() % (MODEL_MAX_OFFSET - offset);
+			for (size_t k = 0; k < size; ++k)
+				buf[k] = (char) (step + k);
+
+			int fd = ufs_open(name, UFS_CREATE);
+			CHECK(fd != -1);
+			f->exists = true;
+			ssize_t rc = ufs_pwrite(fd, buf, size, offset);
+			if (rc == -1) {
+				// only the memory limit can fail it, the
+				// data written up to the fail is kept
+				CHECK(ufs_errno() == UFS_ERR_NO_MEM);
+				model_sync(f, name);
+			} else {
+				CHECK(rc == (ssize_t) size);
+				if (size && offset + size > f->size)
+					model_resize(f, offset + size);
+				memcpy(f->data + offset, buf, size);
+			}
+			CHECK(ufs_close(fd) == 0);
+		} else if (op < 7) {
+			size_t size = rand() % MODEL_MAX_OFFSET;
+			int fd = ufs_open(name, UFS_CREATE);
+			f->exists = true;
+			if (ufs_resize(fd, size) == 0)
+				model_resize(f, size);
+			else
+				CHECK(ufs_errno() == UFS_ERR_NO_MEM);
+			CHECK(ufs_close(fd) == 0);
+		} else if (op < 8) {
+			CHECK((ufs_delete(name) == 0) == f->exists);
+			f->exists = false;
+			model_resize(f, 0);
+		} else if (op < 9) {
+			int j = rand() % MODEL_FILES;
+			model_name(j, other);
+			struct model_file *src = &mem.files[j];
+			CHECK((ufs_clone(other, name) == 0) == src->exists);
+			if (src->exists && j != i) {
+				model_resize(f, src->size);
+				memcpy(f->data, src->data, src->size);
+				f->exists = true;
+			}
+		} else if (op < 10) {
+			CHECK(ufs_save(image) == 0);
+			model_copy(&disk, &mem);
+		} else if (op < 11) {
+			if (journal_on) {
+				ufs_journal_stop();
+			} else {
+				CHECK(ufs_journal_start(image) == 0);
+				model_copy(&disk, &mem);
+			}
+			journal_on = !journal_on;
+		} else if (op < 12) {
+			// a crash: the files are what is on the disk
+			CHECK(ufs_load(image) == 0);
+			model_check(&disk);
+			model_copy(&mem, &disk);
+		} else if (op < 13) {
+			ufs_set_compression(rand() % 3);
+			ufs_compress_tick();
+		} else if (op < 14) {
+			struct ufs_stats st;
+			ufs_stats(&st);
+			ufs_set_memory_limit(rand() % 2 ? 0 : st.data_bytes + rand() % (64 * KB));
+		} else {
+			model_check(&mem);
+		}
+
+		if (journal_on)
+			model_copy(&disk, &mem);
+	}
+
+	model_check(&mem);
+	if (journal_on)
+		ufs_journal_stop();
+	ufs_set_memory_limit(0);
+	ufs_set_compression(0);
+	for (int i = 0; i < MODEL_FILES; ++i) {
+		model_name(i, name);
+		if (mem.files[i].exists)
+			CHECK(ufs_delete(name) == 0);
+	}
+	unlink(image);
+	unlink(journal);
+	model_free(&mem);
+	model_free(&disk);
+	free(buf);
+	check_empty();
+}
+
+/**
+ * Readers, writers, borrowers and the compressor on the same
+ * files at once. Run it under -fsanitize=thread to check the
+ * locking.
+ */
+enum {
+	THREADS = 8,
+	THREAD_ITERATIONS = 200,
+	SHARED_SIZE = MB,
+};
+
+static int stop_ticker;
+
+/** The shared file is all 'a' or all 'b', never mixed. */
+static void *reader_thread(void *arg) {
+	(void) arg;
+	char *buf = malloc(SHARED_SIZE);
+	for (int i = 0; i < THREAD_ITERATIONS; ++i) {
+		int fd = ufs_open("shared", UFS_READ_ONLY);
+		CHECK(fd != -1);
+		CHECK(ufs_pread(fd, buf, SHARED_SIZE, 0) == SHARED_SIZE);
+		for (size_t k = 1; k < SHARED_SIZE; k += 4 * KB)
+			CHECK(buf[k] == buf[0]);
+		CHECK(ufs_close(fd) == 0);
+	}
+	free(buf);
+	return NULL;
+}
+
+static void *writer_thread(void *arg) {
+	char *buf = malloc(SHARED_SIZE);
+	char name[16];
+	snprintf(name, sizeof(name), "own%ld", (long) arg);
+	for (int i = 0; i < THREAD_ITERATIONS; ++i) {
+		memset(buf, i % 2 ? 'a' : 'b', SHARED_SIZE);
+		int fd = ufs_open("shared", UFS_WRITE_ONLY);
+		CHECK(ufs_pwrite(fd, buf, SHARED_SIZE, 0) == SHARED_SIZE);
+		CHECK(ufs_close(fd) == 0);
+
+		// own file: create, write, delete with the file open
+		fd = ufs_open(name, UFS_CREATE);
+		CHECK(ufs_write(fd, name, strlen(name)) == (ssize_t) strlen(name));
+		CHECK(ufs_delete(name) == 0);
+		CHECK(ufs_close(fd) == 0);
+	}
+	free(buf);
+	return NULL;
+}
+
+static void *borrower_thread(void *arg) {
+	(void) arg;
+	for (int i = 0; i < THREAD_ITERATIONS; ++i) {
+		int fd = ufs_open("shared", 0);
+		struct iovec iov[4];
+		int cnt = 4;
+		CHECK(ufs_read_borrow(fd, 8 * KB, iov, &cnt) > 0);
+		char first = ((char *) iov[0].iov_base)[0];
+		CHECK(first == 'a' || first == 'b');
+		CHECK(ufs_read_release(fd) == 0);
+		CHECK(ufs_clone("shared", "cloned") == 0);
+		CHECK(ufs_close(fd) == 0);
+	}
+	return NULL;
+}
+
+static void *ticker_thread(void *arg) {
+	(void) arg;
+	struct ufs_stats st;
+	while (!__atomic_load_n(&stop_ticker, __ATOMIC_RELAXED)) {
+		ufs_compress_tick();
+		ufs_stats(&st);
+	}
+	return NULL;
+}
+
+static void test_threads(void) {
+	char *buf = malloc(SHARED_SIZE);
+	memset(buf, 'a', SHARED_SIZE);
+	write_file("shared", buf, SHARED_SIZE);
+	free(buf);
+
+	ufs_set_compression(1);
+	pthread_t ticker, threads[THREADS];
+	CHECK(pthread_create(&ticker, NULL, ticker_thread, NULL) == 0);
+	for (long i = 0; i < THREADS; ++i) {
+		void *(*func)(void *) = i % 4 == 0 ? writer_thread
+			: i % 4 == 1 ? borrower_thread : reader_thread;
+		CHECK(pthread_create(&threads[i], NULL, func, (void *) i) == 0);
+	}
+	for (int i = 0; i < THREADS; ++i)
+		CHECK(pthread_join(threads[i], NULL) == 0);
+	__atomic_store_n(&stop_ticker, 1, __ATOMIC_RELAXED);
+	CHECK(pthread_join(ticker, NULL) == 0);
+	ufs_set_compression(0);
+
+	CHECK(ufs_delete("shared") == 0 && ufs_delete("cloned") == 0);
+	check_empty();
+}
+
+int main(void) {
+	snprintf(image, sizeof(image), "/tmp/ufs_test_%d.img", (int) getpid());
+	snprintf(journal, sizeof(journal), "%s.journal", image);
+
+	struct {
+		const char *name;
+		void (*func)(void);
+	} tests[] = {
+		{"basic", test_basic},
+		{"big file", test_big_file},
+		{"many files", test_many_files},
+		{"slab", test_slab},
+		{"block sizes", test_block_sizes},
+		{"resize", test_resize},
+		{"positional", test_positional},
+		{"borrow", test_borrow},
+		{"clone", test_clone},
+		{"persist", test_persist},
+		{"sparse", test_sparse},
+		{"descriptors", test_descriptors},
+		{"inline", test_inline},
+		{"stats", test_stats},
+		{"compress", test_compress},
+		{"model", test_model},
+		{"threads", test_threads},
+	};
+
+	for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); ++i) {
+		tests[i].func();
+		printf("ok - %s\n", tests[i].name);
+	}
+	return 0;
+}
@@ -3,16 +3,90 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "userfs.h"
+#include "slab.h"
+#include "lz.h"
 
 enum {
+	/** Default size of the first extent of a file. */
 	BLOCK_SIZE = 512,
+	MIN_BLOCK_SIZE = 64,
+	/** Extents stop growing at this size. */
+	MAX_EXTENT_SIZE = 1024 * 1024,
 	MAX_FILE_SIZE = 1024 * 1024 * 100,
+	/** Files up to this size keep data in the file record. */
+	INLINE_SIZE = 64,
+	/** Chunk of the name arena, it is aligned to its size. */
+	NAME_CHUNK_SIZE = 64 * 1024,
+	/** Longer names are allocated on their own. */
+	MAX_ARENA_NAME = 1024,
 };
 
-/** Global error code. Set from any function on any error. */
-static enum ufs_error_code ufs_error_code = UFS_ERR_NO_ERR;
+/** log2 of the first extent size for new files. */
+static int block_shift = 9;
+
+/** Zeros which holes are borrowed from. It is never written. */
+static char zero_extent[MAX_EXTENT_SIZE];
+
+/**
+ * Memory of file data given out by alloc_data(), and the limit
+ * of it, 0 if there is none. Changed atomically.
+ */
+static size_t data_bytes = 0;
+static size_t memory_limit = 0;
+/**
+ * Set while the journal is replayed by this thread: its records
+ * are done already, they can't fail on the limit.
+ */
+static __thread bool ignore_memory_limit = false;
+/** Bytes of loaded images which are still used. */
+static size_t mapped_bytes = 0;
+/** Files deleted while opened, changed atomically. */
+static size_t deleted_file_count = 0;
+
+/**
+ * Access clock, it ticks in ufs_compress_tick(). Extents keep the
+ * time of their last access, and the ones idle for compress_idle
+ * ticks are compressed. 0 means no compression.
+ */
+static uint32_t access_clock = 0;
+static uint32_t compress_idle = 0;
+/** Compressed bytes of all the files, a part of data_bytes. */
+static size_t packed_bytes = 0;
+
+/** Counters of ufs_stats(), updated atomically. */
+static struct ufs_op_stats op_stats[UFS_OP_COUNT];
+
+/** Start of a timed operation, see time_op(). */
+struct op_timer {
+	enum ufs_op op;
+	uint64_t start;
+};
+
+static uint64_t now_ns(void);
+
+static void op_timer_stop(struct op_timer *t);
+
+/**
+ * Times the rest of the calling function as the operation: the
+ * timer stops when it goes out of scope, on any return.
+ */
+#define time_op(kind)                                                \
+    __attribute__((cleanup(op_timer_stop))) struct op_timer op_timer = \
+        {.op = (kind), .start = now_ns()}
+
+/** Error code of the thread. Set from any function on any error. */
+static __thread enum ufs_error_code ufs_error_code = UFS_ERR_NO_ERR;
 
 #define throw_err(err)          \
     do {                        \
@@ -21,81 +95,399 @@ static enum ufs_error_code ufs_error_code = UFS_ERR_NO_ERR;
     }while(0)
 
 
-struct block {
-	/** Block memory. */
+/**
+ * Contiguous piece of file data. Extents of a file grow
+ * geometrically: the first one is the file's block size, every
+ * next one is twice bigger, up to MAX_EXTENT_SIZE. So a big file
+ * is a few big extents, and a big read or write is a few memcpy.
+ */
+struct extent {
+	/**
+	 * Extent memory from the slab allocator. NULL for a hole, it
+	 * reads as zeros and gets memory on the first write.
+	 */
 	char *memory;
-	/** How many bytes are occupied. */
-	int occupied;
-	/** Next block in the file. */
-	struct block *next;
-	/** Previous block in the file. */
-	struct block *prev;
-
-	/* PUT HERE OTHER MEMBERS */
+	/**
+	 * Set if the memory is shared with clones of the file, NULL
+	 * if the extent owns it alone. Shared memory is copied on
+	 * the first write.
+	 */
+	struct extent_share *share;
+	/**
+	 * Compressed data of a cold extent, its memory is NULL then.
+	 * It is decompressed on the next access.
+	 */
+	char *packed;
+	uint32_t packed_size;
+	/** Access clock of the last access, see ufs_compress_tick(). */
+	uint32_t stamp;
 };
 
-#define for_each_block(list, item)  \
-    for (struct block *item = list; item != NULL; item = item->next)
+/** Owners of extent memory shared by several files. */
+struct extent_share {
+	/** How many extents refer to the memory, changed atomically. */
+	int refs;
+	/** Size of the memory, to free it. */
+	size_t size;
+	/**
+	 * Mapped image the memory is in, NULL if it is from the slab
+	 * allocator. All extents of a loaded image share one owner,
+	 * and the image is unmapped with the last of them.
+	 */
+	void *map;
+	size_t map_size;
+};
 
 
 struct file {
-	/** Double-linked list of file blocks. */
-	struct block *block_list;
 	/**
-	 * Last block in the list above for fast access to the end
-	 * of file.
+	 * Index of file extents. Sizes of extents depend only on
+	 * their number, so the extent of any offset is computed in
+	 * O(1). Extents behind the index are holes, as well as the
+	 * ones without memory, so a file grows without allocations.
+	 */
+	struct extent *extents;
+	/** How many extents are used. */
+	size_t num_extents;
+	/** How many extents the index can hold without realloc. */
+	size_t extent_capacity;
+	/** log2 of the first extent size, fixed at creation. */
+	int block_shift;
+	/**
+	 * How many file descriptors are opened on the file. Changed
+	 * atomically under the read lock of the file table.
 	 */
-	struct block *last_block;
-	/** How many file descriptors are opened on the file. */
 	int refs;
 	/** File name. */
 	const char *name;
-	/** Files are stored in a double-linked list. */
-	struct file *next;
-	struct file *prev;
+	/** Hash of the name, to skip most of strcmp calls. */
+	uint32_t hash;
+	/** Unique number of the file, journal records refer to it. */
+	uint64_t ino;
 
 	size_t size;
+	/**
+	 * Bumped when extents may be freed or the file shrinks, so
+	 * descriptors know their cursors are stale.
+	 */
+	uint64_t generation;
+	/**
+	 * How many borrows of the file memory are not released. While
+	 * there are any, extents behind the end are not freed.
+	 */
+	int pins;
+	/**
+	 * Shared extents replaced by their copies while the file was
+	 * pinned. Borrowed memory can be there, so they are dropped
+	 * after the last release.
+	 */
+	struct extent *retired;
+	size_t num_retired;
+	/** How many extents are compressed. */
+	size_t num_packed;
+	/**
+	 * Readers of the file data share it, writers and resize take
+	 * it exclusively.
+	 */
+	pthread_rwlock_t lock;
+	/**
+	 * File is deleted but still opened. It is not in the file
+	 * table anymore, only descriptors refer to it.
+	 */
 	bool to_del;
+	/**
+	 * Data of a small file is kept in inline_data and it has no
+	 * extents, until it grows over INLINE_SIZE. It does not go
+	 * back when the file shrinks.
+	 */
+	bool inlined;
+	char inline_data[INLINE_SIZE];
+};
+
+/**
+ * Names of files are packed into big chunks, so a name costs its
+ * length only. Every chunk counts its live names and is freed
+ * with the last one, unless it is the chunk names are added to.
+ */
+struct name_chunk {
+	/** Names not freed, changed atomically. */
+	int live;
+	/** Bytes used, including the header. */
+	size_t used;
+};
+
+static struct name_chunk *name_chunk = NULL;
+
+/**
+ * Open-addressing hash table of files which can be opened by
+ * name, with linear probing. Capacity is a power of two. Slots
+ * of removed files are marked with a tombstone, so probe chains
+ * going through them are not broken.
+ */
+static struct file **file_table = NULL;
+static size_t file_table_capacity = 0;
+/** Occupied slots: files and tombstones. */
+static size_t file_table_used = 0;
+static size_t file_table_count = 0;
+
+static struct file file_tombstone;
+#define TOMBSTONE (&file_tombstone)
+
+/**
+ * Lock of the file table, snapshots and block_shift. Lookups
+ * share it, so opening existing files does not serialize;
+ * creation and deletion take it exclusively. It is taken before
+ * file locks, never after.
+ */
+static pthread_rwlock_t files_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/**
+ * Snapshots of the file table: clones of all the files, which
+ * are not opened by anyone. The index is the snapshot id, slots
+ * of deleted snapshots are NULL.
+ */
+struct snapshot {
+	struct file **files;
+	size_t count;
+};
+
+static struct snapshot **snapshots = NULL;
+static int snapshot_capacity = 0;
+
+/** Number of the next created file. */
+static uint64_t next_ino = 1;
+
+/**
+ * Journal of changes made after the image was saved, it is
+ * replayed on load of the image. -1 if there is no journal.
+ */
+static int journal_fd = -1;
+/** Image path of the journal. */
+static char *journal_image = NULL;
+/**
+ * Appends go one by one under it, so a failed one can be cut off
+ * before the next one comes. The journal is switched under it too.
+ */
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+
+enum journal_op {
+	JOURNAL_CREATE = 1,
+	JOURNAL_WRITE,
+	JOURNAL_RESIZE,
+	JOURNAL_DELETE,
+	JOURNAL_CLONE,
+};
+
+/**
+ * Journal record, followed by the name and the data. The file is
+ * the one created with the number, so writes to a file deleted
+ * and created again do not mix.
+ */
+struct journal_record {
+	uint32_t op;
+	uint32_t name_len;
+	uint64_t ino;
+	/** Offset of a write, size for resize, new file for clone. */
+	uint64_t arg;
+	/** Size of the data. */
+	uint64_t len;
+};
+
+#define IMAGE_MAGIC "UFSIMG1"
+
+/**
+ * Image starts with the header and file records, each record is
+ * followed by the name and aligned to 8 bytes. File data lies
+ * after them, contiguously per file, so it is used right from
+ * the mapped image.
+ */
+struct image_header {
+	char magic[8];
+	uint64_t count;
+	uint64_t next_ino;
 };
 
-/** List of all files. */
-static struct file *file_list = NULL;
+struct image_file {
+	uint64_t ino;
+	uint64_t size;
+	/** Offset of the data in the image. */
+	uint64_t data;
+	uint32_t name_len;
+	uint32_t block_shift;
+};
 
-#define for_each_file(item)  \
-    for (struct file *item = file_list; item != NULL; item = item->next)
+enum {
+	/** Alignment of file data in the image. */
+	IMAGE_ALIGN = 64,
+};
 
 /* helpful file operations */
+static uint32_t hash_name(const char *name);
+
 static struct file *find_file(const char *name);
 
 static void add_file(struct file *f);
 
+static void unlink_file(struct file *f);
+
 static void remove_file(struct file *f);
 
+static void free_file(struct file *f);
+
+static struct file *clone_file(struct file *src, const char *name);
+
+static void delete_file(struct file *f);
+
+static void free_snapshot(struct snapshot *snap);
+
+static struct file *new_file(const char *name, int shift);
+
+static const char *alloc_name(const char *name);
+
+static void free_name(const char *name);
+
+static int promote_inline(struct file *f);
+
+static void shrink_file(struct file *f, size_t new_size);
+
+static int journal_append(uint32_t op, uint64_t ino, uint64_t arg, const char *name,
+			  const void *data, size_t len);
+
+static int journal_write(struct file *f, size_t offset, const struct iovec *iov,
+			 int iovcnt, size_t size);
+
+static char *path_with_suffix(const char *path, const char *suffix);
+
+static int save_image(const char *path);
+
+static int write_packed(int fd, const struct extent *e, size_t len, char **buf);
+
+static int load_image(const char *path);
+
 static int verify_fd(int fd);
 
-static struct block *add_block(struct file *f);
+static size_t extent_size(const struct file *f, size_t idx);
+
+static size_t extent_start(const struct file *f, size_t idx);
+
+static size_t extent_of(const struct file *f, size_t offset);
+
+static char *fill_hole(struct file *f, size_t idx);
+
+static void truncate_extents(struct file *f, size_t num_extents);
+
+static void drop_retired(struct file *f);
+
+static void drop_extent(struct extent *e, size_t size);
+
+static char *alloc_data(size_t size);
+
+static void free_data(char *memory, size_t size);
+
+static uint32_t access_time(void);
+
+static int pack_cold_extents(struct file *f, uint32_t now, uint32_t idle);
+
+static int pack_extent(struct file *f, size_t idx);
+
+static int unpack_extent(struct file *f, size_t idx);
+
+static bool has_packed(const struct file *f, size_t offset, size_t size);
+
+static int unpack_range(struct file *f, size_t offset, size_t size);
+
+static int rdlock_unpacked(struct file *f, size_t offset, size_t size);
+
+static char *unshare_extent(struct file *f, size_t idx);
+
+/**
+ * Position of a descriptor in the file layout, so sequential
+ * reads and writes do not look for their extent on every call.
+ */
+struct cursor {
+	/** File generation the cursor was set at. */
+	uint64_t generation;
+	/** Memory of the extent, NULL for a hole. */
+	char *memory;
+	size_t idx;
+	/**
+	 * File offsets of the extent beginning and end. End is 0 if
+	 * the cursor is not set.
+	 */
+	size_t start;
+	size_t end;
+};
 
 struct filedesc {
 	struct file *file;
 
 	int flags;
 	size_t offset;
+	struct cursor cursor;
+	/** Borrows made through the descriptor and not released. */
+	int pins;
 };
 
 /* helpful descriptor operations */
-static int push_descriptor(struct filedesc *desc);
+static int alloc_descriptor(void);
+
+static void free_descriptor(int fd);
+
+static struct filedesc *descriptor_slot(int fd);
+
+static void resize_desc_index(int capacity);
+
+static struct filedesc *get_descriptor(int fd);
 
 static void fix_offset(struct filedesc *desc);
 
+static void sync_cursor(struct filedesc *desc);
+
+static char *seek_cursor(struct file *f, struct cursor *c, size_t offset);
+
+static int grow_file(struct file *f, size_t new_size);
+
+static void trim_extents(struct file *f);
+
+static void unpin_file(struct file *f, int pins);
+
+static bool file_pinned(struct file *f);
+
+static size_t file_write_at(struct file *f, struct cursor *c, size_t offset,
+			    const struct iovec *iov, int iovcnt);
+
+static size_t file_read_at(struct file *f, struct cursor *c, size_t offset,
+			   const struct iovec *iov, int iovcnt);
+
+static size_t iov_size(const struct iovec *iov, int iovcnt);
+
+enum {
+	/** Descriptors in one chunk of the table, bits in a word. */
+	DESC_CHUNK = 64,
+};
+
 /**
- * An array of file descriptors. When a file descriptor is
- * created, its pointer drops here. When a file descriptor is
- * closed, its place in this array is set to NULL and can be
- * taken by next ufs_open() call.
+ * Table of file descriptors, stored right in fixed chunks. A
+ * chunk never moves, so a descriptor found under the lock can be
+ * used after the lock is released. The index of chunks grows
+ * geometrically. A closed descriptor is marked free in the bitmap
+ * of its chunk, and ufs_open() takes the lowest free one.
  */
-static struct filedesc **file_descriptors = NULL;
+static struct filedesc **desc_chunks = NULL;
+/** Bit i is set if descriptor i of the chunk is free. */
+static uint64_t *desc_free = NULL;
+static int desc_chunk_count = 0;
+static int desc_chunk_capacity = 0;
+/** Chunks before this one have no free descriptors. */
+static int desc_first_free = 0;
 static int file_descriptor_count = 0;
-static int file_descriptor_capacity = 0;
+
+/**
+ * Lock of the descriptor table. It is held only to find a
+ * descriptor, the I/O itself goes under the file lock. One
+ * descriptor must not be used by several threads at once.
+ */
+static pthread_rwlock_t descriptors_lock = PTHREAD_RWLOCK_INITIALIZER;
 
 enum ufs_error_code
 ufs_errno()
@@ -103,370 +495,2174 @@ ufs_errno()
 	return ufs_error_code;
 }
 
+void
+ufs_set_block_size(size_t size)
+{
+	if (size < MIN_BLOCK_SIZE)
+		size = MIN_BLOCK_SIZE;
+	if (size > MAX_EXTENT_SIZE)
+		size = MAX_EXTENT_SIZE;
+
+	// round up to a power of two
+	int shift = 0;
+	while (((size_t) 1 << shift) < size)
+		++shift;
+
+	pthread_rwlock_wrlock(&files_lock);
+	block_shift = shift;
+	pthread_rwlock_unlock(&files_lock);
+}
+
 int
 ufs_open(const char *filename, int flags)
 {
+	time_op(UFS_OP_OPEN);
+
+	pthread_rwlock_rdlock(&files_lock);
 	struct file *f = find_file(filename);
-	if (!f && !(flags & UFS_CREATE))
-		throw_err(UFS_ERR_NO_FILE);
+	if (f)
+		__atomic_add_fetch(&f->refs, 1, __ATOMIC_RELAXED);
+	pthread_rwlock_unlock(&files_lock);
+
+	if (!f && (flags & UFS_CREATE)) {
+		pthread_rwlock_wrlock(&files_lock);
+
+		// another thread could create it in between
+		f = find_file(filename);
+		int journal_err = 0;
+		if (!f) {
+			// create file here
+			f = new_file(filename, block_shift);
+			add_file(f);
+			journal_err = journal_append(JOURNAL_CREATE, f->ino, f->block_shift,
+						     filename, NULL, 0);
+		}
 
-	if (!f) {
-		// create file here
-		f = (struct file *) malloc(sizeof(struct file));
-		*f = (struct file) {
-			.block_list = NULL,
-			.last_block = NULL,
-			.name = strdup(filename),
-			.next = NULL,
-			.prev = NULL,
-			.refs = 0,
-			.size = 0,
-			.to_del = false,
-		};
+		if (!journal_err)
+			__atomic_add_fetch(&f->refs, 1, __ATOMIC_RELAXED);
+		pthread_rwlock_unlock(&files_lock);
 
-		add_file(f);
+		if (journal_err)
+			throw_err(UFS_ERR_IO);
 	}
 
-	++(f->refs);
+	if (!f)
+		throw_err(UFS_ERR_NO_FILE);
 
-	struct filedesc *desc = (struct filedesc*) malloc(sizeof(struct filedesc));
-	*desc = (struct filedesc) {
+	struct filedesc desc = {
 		.file = f,
 		.flags = flags,
 		.offset = 0,
+		.cursor = {
+			.generation = 0,
+			.memory = NULL,
+		},
+		.pins = 0,
 	};
 
-	return push_descriptor(desc);
+	// the generation is checked under the file lock, the cursor
+	// is empty anyway
+	pthread_rwlock_rdlock(&f->lock);
+	desc.cursor.generation = f->generation;
+	pthread_rwlock_unlock(&f->lock);
+
+	pthread_rwlock_wrlock(&descriptors_lock);
+	int fd = alloc_descriptor();
+	*descriptor_slot(fd) = desc;
+	pthread_rwlock_unlock(&descriptors_lock);
+
+	return fd;
 }
 
 ssize_t
-ufs_write(int _fd, const char *buf, size_t size)
+ufs_write(int fd, const char *buf, size_t size)
 {
-	int fd_err;
-	if (fd_err = verify_fd(_fd), fd_err)
-		throw_err(fd_err);
+	struct iovec iov = {.iov_base = (char *) buf, .iov_len = size};
+	return ufs_writev(fd, &iov, 1);
+}
+
+ssize_t
+ufs_writev(int _fd, const struct iovec *iov, int iovcnt)
+{
+	time_op(UFS_OP_WRITE);
 
-	struct filedesc *fd = file_descriptors[_fd];
+	struct filedesc *fd = get_descriptor(_fd);
+	if (!fd)
+		throw_err(UFS_ERR_NO_FILE);
 
 	if (fd->flags & UFS_READ_ONLY)
 		throw_err(UFS_ERR_NO_PERMISSION); 
-	
-	fix_offset(fd); // in case of resize
 
 	struct file *f = fd->file;
-	if (!f->last_block)
-		add_block(f);
+	pthread_rwlock_wrlock(&f->lock);
 
-	int skip = 0;
-	struct block *b = f->block_list;
+	sync_cursor(fd); // in case of resize
 
-	while (fd->offset > (skip + 1) * BLOCK_SIZE) {
-		b = b->next;
-		++skip;
+	size_t size = iov_size(iov, iovcnt);
+	size_t written = file_write_at(f, &fd->cursor, fd->offset, iov, iovcnt);
+	int journal_err = journal_write(f, fd->offset, iov, iovcnt, written);
+	fd->offset += written;
 
-		if (!b)
-			b = add_block(f);
-	}
+	pthread_rwlock_unlock(&f->lock);
+
+	if (written < size)
+		throw_err(UFS_ERR_NO_MEM);
 
-	size_t block_offset = fd->offset % BLOCK_SIZE;
-	size_t written = 0;
+	if (journal_err)
+		throw_err(UFS_ERR_IO);
 
-	while (written < size) {
-		if (b->occupied == BLOCK_SIZE) {
-			b = (b->next == NULL ? add_block(f) : b->next);
-			block_offset = 0;
-		}
+	return written;
+}
 
-		size_t to_write = BLOCK_SIZE - block_offset;
+ssize_t
+ufs_pwrite(int _fd, const char *buf, size_t size, size_t offset)
+{
+	time_op(UFS_OP_WRITE);
 
-		// check if data to write is less than block size
-		if (to_write > size - written)
-				to_write = size - written;
-		
+	struct filedesc *fd = get_descriptor(_fd);
+	if (!fd)
+		throw_err(UFS_ERR_NO_FILE);
 
-		if (f->size + to_write > MAX_FILE_SIZE)
-			break;
+	if (fd->flags & UFS_READ_ONLY)
+		throw_err(UFS_ERR_NO_PERMISSION);
+
+	// as pwrite(2), nothing to write does not grow the file
+	if (!size)
+		return 0;
 
-		memcpy(b->memory + block_offset, buf + written, to_write);
+	if (offset >= MAX_FILE_SIZE)
+		throw_err(UFS_ERR_NO_MEM);
 
+	struct file *f = fd->file;
+	pthread_rwlock_wrlock(&f->lock);
 
-		fd->offset += to_write;
-		block_offset += to_write;
-		
-		b->occupied = b->occupied >  block_offset ? b->occupied : block_offset;
-		f->size = fd->offset > f->size ? fd->offset : f->size;
-		written += to_write;
+	// a gap before the offset reads as zeros
+	size_t old_size = f->size;
+	if (offset > f->size && grow_file(f, offset)) {
+		pthread_rwlock_unlock(&f->lock);
+		throw_err(UFS_ERR_NO_MEM);
 	}
 
-	if (written < size && f->size == MAX_FILE_SIZE)
+	struct iovec iov = {.iov_base = (char *) buf, .iov_len = size};
+	struct cursor c = {.memory = NULL};
+	size_t written = file_write_at(f, &c, offset, &iov, 1);
+
+	// the gap is kept only along with the data, the journal has
+	// no record of it otherwise
+	if (!written && f->size != old_size)
+		shrink_file(f, old_size);
+
+	int journal_err = journal_write(f, offset, &iov, 1, written);
+
+	pthread_rwlock_unlock(&f->lock);
+
+	if (written < size)
 		throw_err(UFS_ERR_NO_MEM);
 
+	if (journal_err)
+		throw_err(UFS_ERR_IO);
+
 	return written;
 }
 
 ssize_t
-ufs_read(int _fd, char *buf, size_t size)
+ufs_read(int fd, char *buf, size_t size)
 {
-	int fd_err;
-	if (fd_err = verify_fd(_fd), fd_err)
-		throw_err(fd_err);
+	struct iovec iov = {.iov_base = buf, .iov_len = size};
+	return ufs_readv(fd, &iov, 1);
+}
+
+ssize_t
+ufs_readv(int _fd, const struct iovec *iov, int iovcnt)
+{
+	time_op(UFS_OP_READ);
 
-	struct filedesc *fd = file_descriptors[_fd];
+	struct filedesc *fd = get_descriptor(_fd);
+	if (!fd)
+		throw_err(UFS_ERR_NO_FILE);
 
 	if (fd->flags & UFS_WRITE_ONLY)
 		throw_err(UFS_ERR_NO_PERMISSION);
 
-	fix_offset(fd); // in case of resize
-		
-	struct block *cur = fd->file->block_list;
-	if (!cur)
-		return 0;
-	
-	// move to poiner offset
-	for (int i = 0; i < fd->offset / BLOCK_SIZE; ++i, cur = cur->next)
-		if (!cur) return 0;
+	struct file *f = fd->file;
+	if (rdlock_unpacked(f, fd->offset, iov_size(iov, iovcnt)))
+		throw_err(UFS_ERR_NO_MEM);
+
+	sync_cursor(fd); // in case of resize
+
+	size_t done = file_read_at(f, &fd->cursor, fd->offset, iov, iovcnt);
+	fd->offset += done;
 
-	size_t block_offset = fd->offset % BLOCK_SIZE;
+	pthread_rwlock_unlock(&f->lock);
+
+	return done;
+}
+
+ssize_t
+ufs_pread(int _fd, char *buf, size_t size, size_t offset)
+{
+	time_op(UFS_OP_READ);
+
+	struct filedesc *fd = get_descriptor(_fd);
+	if (!fd)
+		throw_err(UFS_ERR_NO_FILE);
+
+	if (fd->flags & UFS_WRITE_ONLY)
+		throw_err(UFS_ERR_NO_PERMISSION);
+
+	struct file *f = fd->file;
+	if (rdlock_unpacked(f, offset, size))
+		throw_err(UFS_ERR_NO_MEM);
+
+	struct iovec iov = {.iov_base = buf, .iov_len = size};
+	struct cursor c = {.memory = NULL};
+	size_t done = file_read_at(f, &c, offset, &iov, 1);
+
+	pthread_rwlock_unlock(&f->lock);
+
+	return done;
+}
+
+ssize_t
+ufs_read_borrow(int _fd, size_t size, struct iovec *out, int *cnt)
+{
+	time_op(UFS_OP_READ);
+
+	struct filedesc *fd = get_descriptor(_fd);
+	if (!fd)
+		throw_err(UFS_ERR_NO_FILE);
+
+	if (fd->flags & UFS_WRITE_ONLY)
+		throw_err(UFS_ERR_NO_PERMISSION);
+
+	struct file *f = fd->file;
+	if (rdlock_unpacked(f, fd->offset, size))
+		throw_err(UFS_ERR_NO_MEM);
+
+	sync_cursor(fd); // in case of resize
+
+	int n = 0;
 	size_t done = 0;
 
-	while (done < size) {
-		if (block_offset == BLOCK_SIZE) {
-			cur = cur->next;
-			block_offset = 0;
+	while (n < *cnt && done < size && fd->offset < f->size) {
+		char *src = seek_cursor(f, &fd->cursor, fd->offset);
+		// a hole is not filled to be read, a later write into it
+		// goes to new memory and is not seen by the borrower
+		if (!src)
+			src = zero_extent;
 
-			if (!cur) break;
-		}
+		size_t len = fd->cursor.end - fd->offset;
+		if (len > size - done)
+			len = size - done;
 
-		if (cur->occupied - block_offset == 0)
-			break;
+		if (len > f->size - fd->offset)
+			len = f->size - fd->offset;
 
-		size_t to_read = BLOCK_SIZE - block_offset;
-		
-		if (to_read > size - done)
-			to_read = size - done;
-		
-		if (to_read > cur->occupied - block_offset)
-			to_read = cur->occupied - block_offset;
-		
-		memcpy(buf + done, cur->memory + block_offset, to_read);
+		out[n++] = (struct iovec) {.iov_base = src, .iov_len = len};
+		fd->offset += len;
+		done += len;
+	}
 
-		fd->offset += to_read;
-		done += to_read;
-		block_offset += to_read;
+	// borrows run under the read lock along with each other
+	if (done) {
+		++fd->pins;
+		__atomic_add_fetch(&f->pins, 1, __ATOMIC_RELAXED);
 	}
 
+	pthread_rwlock_unlock(&f->lock);
+
+	*cnt = n;
 	return done;
 }
 
+int
+ufs_read_release(int _fd)
+{
+	struct filedesc *fd = get_descriptor(_fd);
+	if (!fd)
+		throw_err(UFS_ERR_NO_FILE);
+
+	if (fd->pins) {
+		--fd->pins;
+		unpin_file(fd->file, 1);
+	}
+
+	return 0;
+}
+
+ssize_t
+ufs_size(int _fd)
+{
+	struct filedesc *fd = get_descriptor(_fd);
+	if (!fd)
+		throw_err(UFS_ERR_NO_FILE);
+
+	struct file *f = fd->file;
+	pthread_rwlock_rdlock(&f->lock);
+	size_t size = f->size;
+	pthread_rwlock_unlock(&f->lock);
+
+	return size;
+}
+
 int
 ufs_close(int fd)
 {
+	pthread_rwlock_wrlock(&descriptors_lock);
+
 	int fd_err;
-	if (fd_err = verify_fd(fd), fd_err)
+	if (fd_err = verify_fd(fd), fd_err) {
+		pthread_rwlock_unlock(&descriptors_lock);
 		throw_err(fd_err);
+	}
+
+	struct filedesc *desc = descriptor_slot(fd);
+	struct file *f = desc->file;
+	int pins = desc->pins;
+	free_descriptor(fd);
 
-	// decrement reference counter
-	struct file *f = file_descriptors[fd]->file;
-	--(f->refs);
+	pthread_rwlock_unlock(&descriptors_lock);
+
+	if (pins)
+		unpin_file(f, pins);
+
+	// decrement reference counter; deletion takes the lock
+	// exclusively, so to_del can't be set in between
+	pthread_rwlock_rdlock(&files_lock);
 
 	// if there are no more reference,
 	// perform delayed deletion if needed
-	if (!f->refs && f->to_del)
+	if (!__atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL) && f->to_del)
 		remove_file(f);
 
-	free(file_descriptors[fd]);
-	file_descriptors[fd] = NULL;
-	--file_descriptor_count;
-
-	// if file descriptor was at the end of the list,
-	// we can decrease list size
-	while (file_descriptors && file_descriptor_capacity > 0
-							&& !file_descriptors[file_descriptor_capacity - 1])
-		free(file_descriptors[--file_descriptor_capacity]);
-	
-	file_descriptors = realloc(file_descriptors,
-							  sizeof(struct filedesc *) * (file_descriptor_capacity));
+	pthread_rwlock_unlock(&files_lock);
 	return 0;
 }
 
 int
 ufs_delete(const char *filename)
 {
+	time_op(UFS_OP_DELETE);
+
+	pthread_rwlock_wrlock(&files_lock);
+
 	struct file *f = find_file(filename);
-	if (!f)
+	if (!f) {
+		pthread_rwlock_unlock(&files_lock);
 		throw_err(UFS_ERR_NO_FILE);
-	
-	if (f->refs) {
-		// file becomes invisible for opening, but
-		// it still exists in memory until last reference is closed
-		f->to_del = true;
-	} else {
-		remove_file(f);
 	}
+
+	int journal_err = journal_append(JOURNAL_DELETE, f->ino, 0, NULL, NULL, 0);
+	delete_file(f);
+
+	pthread_rwlock_unlock(&files_lock);
+
+	if (journal_err)
+		throw_err(UFS_ERR_IO);
 	return 0;
 }
 
 int
-ufs_resize(int _fd, size_t new_size)
+ufs_clone(const char *src, const char *dst)
 {
-	int fd_err;
-	if (fd_err = verify_fd(_fd), fd_err)
-		throw_err(fd_err);
+	pthread_rwlock_wrlock(&files_lock);
 
-	if (new_size >= MAX_FILE_SIZE)
-		throw_err(UFS_ERR_NO_MEM);
+	struct file *f = find_file(src);
+	if (!f) {
+		pthread_rwlock_unlock(&files_lock);
+		throw_err(UFS_ERR_NO_FILE);
+	}
 
-	struct filedesc *fd = file_descriptors[_fd];
-	struct file *f = fd->file;
+	struct file *old = find_file(dst);
+	int journal_err = 0;
+	if (old != f) {
+		if (old)
+			delete_file(old);
+
+		struct file *copy = clone_file(f, dst);
+		add_file(copy);
+		journal_err = journal_append(JOURNAL_CLONE, f->ino, copy->ino, dst, NULL, 0);
+	}
+
+	pthread_rwlock_unlock(&files_lock);
+
+	if (journal_err)
+		throw_err(UFS_ERR_IO);
+	return 0;
+}
+
+int
+ufs_snapshot_create(void)
+{
+	struct snapshot *snap = malloc(sizeof(struct snapshot));
+
+	pthread_rwlock_wrlock(&files_lock);
+
+	*snap = (struct snapshot) {
+		.files = malloc(sizeof(struct file *) * (file_table_count + 1)),
+		.count = 0,
+	};
+
+	for (size_t i = 0; i < file_table_capacity; ++i) {
+		struct file *f = file_table[i];
+		if (f && f != TOMBSTONE)
+			snap->files[snap->count++] = clone_file(f, f->name);
+	}
+
+	int id = 0;
+	while (id < snapshot_capacity && snapshots[id])
+		++id;
+
+	if (id == snapshot_capacity) {
+		snapshots = realloc(snapshots, sizeof(struct snapshot *) * (++snapshot_capacity));
+	}
+	snapshots[id] = snap;
+
+	pthread_rwlock_unlock(&files_lock);
+	return id;
+}
+
+int
+ufs_snapshot_restore(int id)
+{
+	pthread_rwlock_wrlock(&files_lock);
+
+	if (id < 0 || id >= snapshot_capacity || !snapshots[id]) {
+		pthread_rwlock_unlock(&files_lock);
+		throw_err(UFS_ERR_NO_FILE);
+	}
+
+	// current files go away as if they were deleted, opened
+	// descriptors keep working with them
+	for (size_t i = 0; i < file_table_capacity; ++i) {
+		struct file *f = file_table[i];
+		if (f && f != TOMBSTONE)
+			delete_file(f);
+	}
+
+	struct snapshot *snap = snapshots[id];
+	for (size_t i = 0; i < snap->count; ++i)
+		add_file(clone_file(snap->files[i], snap->files[i]->name));
+
+	pthread_rwlock_unlock(&files_lock);
+	return 0;
+}
+
+int
+ufs_snapshot_delete(int id)
+{
+	pthread_rwlock_wrlock(&files_lock);
+
+	if (id < 0 || id >= snapshot_capacity || !snapshots[id]) {
+		pthread_rwlock_unlock(&files_lock);
+		throw_err(UFS_ERR_NO_FILE);
+	}
+
+	free_snapshot(snapshots[id]);
+	snapshots[id] = NULL;
+
+	pthread_rwlock_unlock(&files_lock);
+	return 0;
+}
+
+int
+ufs_save(const char *path)
+{
+	pthread_rwlock_wrlock(&files_lock);
+	int rc = save_image(path);
+	pthread_rwlock_unlock(&files_lock);
+
+	if (rc)
+		throw_err(UFS_ERR_IO);
+
+	return 0;
+}
+
+int
+ufs_load(const char *path)
+{
+	pthread_rwlock_wrlock(&files_lock);
+	int err = load_image(path);
+	pthread_rwlock_unlock(&files_lock);
+
+	if (err)
+		throw_err(err);
+
+	return 0;
+}
 
-	int num_blocks = 0;
-	for_each_block(f->block_list, _) ++num_blocks;
-	
-	while (num_blocks * BLOCK_SIZE < new_size) {
-		add_block(f);
-		++num_blocks;
+int
+ufs_journal_start(const char *path)
+{
+	// records are replayed over the image, so it has to match the
+	// files the journal starts from
+	pthread_rwlock_wrlock(&files_lock);
+	if (save_image(path)) {
+		pthread_rwlock_unlock(&files_lock);
+		throw_err(UFS_ERR_IO);
+	}
+
+	char *journal = path_with_suffix(path, ".journal");
+	int fd = open(journal, O_WRONLY | O_APPEND | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	free(journal);
+
+	if (fd == -1) {
+		pthread_rwlock_unlock(&files_lock);
+		throw_err(UFS_ERR_IO);
 	}
-	
-	if (num_blocks)
-		while ((num_blocks - 1) * BLOCK_SIZE > new_size) {
-			if (f->last_block->prev) {
-				struct block *b = f->last_block->prev;
 
-				free(b->next->memory);
-				free(b->next);
-				b->next = NULL;
+	pthread_mutex_lock(&journal_lock);
+	if (journal_fd != -1)
+		close(journal_fd);
+	free(journal_image);
+	journal_fd = fd;
+	journal_image = strdup(path);
+	pthread_mutex_unlock(&journal_lock);
+	pthread_rwlock_unlock(&files_lock);
+
+	return 0;
+}
+
+void
+ufs_journal_stop(void)
+{
+	pthread_rwlock_wrlock(&files_lock);
+	pthread_mutex_lock(&journal_lock);
+	if (journal_fd != -1)
+		close(journal_fd);
+	free(journal_image);
+	journal_fd = -1;
+	journal_image = NULL;
+	pthread_mutex_unlock(&journal_lock);
+	pthread_rwlock_unlock(&files_lock);
+}
+
+void
+ufs_stats(struct ufs_stats *stats)
+{
+	*stats = (struct ufs_stats) {
+		.files = 0,
+	};
 
-				f->last_block = b;
+	pthread_rwlock_rdlock(&files_lock);
+
+	for (size_t i = 0; i < file_table_capacity; ++i) {
+		struct file *f = file_table[i];
+		if (!f || f == TOMBSTONE)
+			continue;
+
+		pthread_rwlock_rdlock(&f->lock);
+
+		++stats->files;
+		stats->file_bytes += f->size;
+
+		if (f->inlined) {
+			++stats->inline_files;
+		} else if (f->size) {
+			// extents kept behind the end for borrows are not
+			// a part of the file
+			size_t num_extents = extent_of(f, f->size - 1) + 1;
+			for (size_t idx = 0; idx < num_extents; ++idx) {
+				struct extent *e = idx < f->num_extents ? &f->extents[idx] : NULL;
+				if (e && e->packed)
+					++stats->packed_extents;
+				else if (!e || !e->memory)
+					++stats->holes;
+				else if (e->share)
+					++stats->shared_extents;
+				else
+					++stats->extents;
 			}
-			--num_blocks;
 		}
 
-	f->size = new_size;
+		pthread_rwlock_unlock(&f->lock);
+	}
+	stats->extents += stats->shared_extents;
+
+	for (int id = 0; id < snapshot_capacity; ++id)
+		stats->snapshots += snapshots[id] != NULL;
+
+	stats->block_size = (size_t) 1 << block_shift;
+
+	pthread_rwlock_unlock(&files_lock);
+
+	pthread_rwlock_rdlock(&descriptors_lock);
+	stats->descriptors = file_descriptor_count;
+	pthread_rwlock_unlock(&descriptors_lock);
+
+	stats->deleted_files = __atomic_load_n(&deleted_file_count, __ATOMIC_RELAXED);
+	stats->data_bytes = __atomic_load_n(&data_bytes, __ATOMIC_RELAXED);
+	stats->mapped_bytes = __atomic_load_n(&mapped_bytes, __ATOMIC_RELAXED);
+	stats->packed_bytes = __atomic_load_n(&packed_bytes, __ATOMIC_RELAXED);
+	stats->memory_limit = __atomic_load_n(&memory_limit, __ATOMIC_RELAXED);
+
+	struct slab_stats slab;
+	slab_stats(&slab);
+	stats->slab_chunks = slab.chunks;
+	stats->slab_spare_chunks = slab.spare_chunks;
+	stats->slab_chunk_bytes = (slab.chunks - slab.spare_chunks) * SLAB_CHUNK_SIZE;
+	stats->slab_used_bytes = slab.used_bytes;
+	stats->slab_big_objects = slab.big_objects;
+	stats->slab_big_bytes = slab.big_bytes;
+
+	for (int op = 0; op < UFS_OP_COUNT; ++op) {
+		stats->ops[op] = (struct ufs_op_stats) {
+			.count = __atomic_load_n(&op_stats[op].count, __ATOMIC_RELAXED),
+			.total_ns = __atomic_load_n(&op_stats[op].total_ns, __ATOMIC_RELAXED),
+			.max_ns = __atomic_load_n(&op_stats[op].max_ns, __ATOMIC_RELAXED),
+		};
+	}
+}
+
+void
+ufs_set_memory_limit(size_t bytes)
+{
+	__atomic_store_n(&memory_limit, bytes, __ATOMIC_RELAXED);
+}
+
+void
+ufs_set_compression(unsigned idle_ticks)
+{
+	__atomic_store_n(&compress_idle, idle_ticks, __ATOMIC_RELAXED);
+}
+
+int
+ufs_compress_tick(void)
+{
+	uint32_t now = __atomic_add_fetch(&access_clock, 1, __ATOMIC_RELAXED);
+	uint32_t idle = __atomic_load_n(&compress_idle, __ATOMIC_RELAXED);
+	if (!idle)
+		return 0;
+
+	int count = 0;
+	pthread_rwlock_rdlock(&files_lock);
+
+	for (size_t i = 0; i < file_table_capacity; ++i) {
+		struct file *f = file_table[i];
+		if (f && f != TOMBSTONE)
+			count += pack_cold_extents(f, now, idle);
+	}
+
+	// snapshots are never read, their own extents get cold
+	for (int id = 0; id < snapshot_capacity; ++id) {
+		struct snapshot *snap = snapshots[id];
+		for (size_t i = 0; snap && i < snap->count; ++i)
+			count += pack_cold_extents(snap->files[i], now, idle);
+	}
+
+	pthread_rwlock_unlock(&files_lock);
+	return count;
+}
+
+int
+ufs_resize(int _fd, size_t new_size)
+{
+	time_op(UFS_OP_RESIZE);
 
-	if (f->last_block)
-		f->last_block->occupied = new_size % BLOCK_SIZE;
+	struct filedesc *fd = get_descriptor(_fd);
+	if (!fd)
+		throw_err(UFS_ERR_NO_FILE);
+
+	if (new_size >= MAX_FILE_SIZE)
+		throw_err(UFS_ERR_NO_MEM);
+
+	struct file *f = fd->file;
+	pthread_rwlock_wrlock(&f->lock);
+
+	if (new_size > f->size) {
+		if (grow_file(f, new_size)) {
+			pthread_rwlock_unlock(&f->lock);
+			throw_err(UFS_ERR_NO_MEM);
+		}
+	} else {
+		shrink_file(f, new_size);
+	}
+
+	int journal_err = 0;
+	if (!__atomic_load_n(&f->to_del, __ATOMIC_RELAXED))
+		journal_err = journal_append(JOURNAL_RESIZE, f->ino, new_size, NULL, NULL, 0);
+
+	pthread_rwlock_unlock(&f->lock);
 
+	if (journal_err)
+		throw_err(UFS_ERR_IO);
 	return 0;
 }
 
 
 /* private helpful methods */
+static uint32_t hash_name(const char *name) {
+	// FNV-1a
+	uint32_t h = 2166136261u;
+	for (; *name; ++name) {
+		h ^= (unsigned char) *name;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/**
+ * Slot of the file with the name, or the empty slot where
+ * probing for it stopped.
+ */
+static size_t find_slot(const char *name, uint32_t hash) {
+	size_t mask = file_table_capacity - 1;
+	size_t i = hash & mask;
+
+	while (file_table[i]) {
+		struct file *f = file_table[i];
+		if (f != TOMBSTONE && f->hash == hash && !strcmp(f->name, name))
+			break;
+		i = (i + 1) & mask;
+	}
+
+	return i;
+}
+
 static struct file *find_file(const char *name) {
-	struct file *f = NULL;
-	for_each_file(i)
-		if (!i->to_del && !strcmp(i->name, name))
-			f = i;
+	if (!file_table_count)
+		return NULL;
 
-	return f;
+	return file_table[find_slot(name, hash_name(name))];
 }
 
-static void add_file(struct file *f) {
-	if (!file_list) {
-		file_list = f;
-	} else {
-		struct file *last_file = NULL;
-		for_each_file(_f)
-			last_file = _f;
+/** Rebuilds the table with new capacity, dropping tombstones. */
+static void rehash_files(size_t capacity) {
+	struct file **old = file_table;
+	size_t old_capacity = file_table_capacity;
+
+	file_table = calloc(capacity, sizeof(struct file *));
+	file_table_capacity = capacity;
+	file_table_used = file_table_count;
+
+	size_t mask = capacity - 1;
+	for (size_t i = 0; i < old_capacity; ++i) {
+		struct file *f = old[i];
+		if (!f || f == TOMBSTONE)
+			continue;
+
+		size_t j = f->hash & mask;
+		while (file_table[j])
+			j = (j + 1) & mask;
+		file_table[j] = f;
+	}
+
+	free(old);
+}
 
-		last_file->next = f;
-		f->prev = last_file;
+static void add_file(struct file *f) {
+	// keep at least a half of slots empty, so probe chains
+	// stay short; many tombstones are just dropped
+	if ((file_table_used + 1) * 2 > file_table_capacity) {
+		size_t capacity = file_table_capacity ? file_table_capacity : 16;
+		while ((file_table_count + 1) * 4 > capacity)
+			capacity *= 2;
+		rehash_files(capacity);
 	}
+
+	// file is added only if it was not found, so the probe
+	// ends at an empty slot; a tombstone on the way is reused
+	size_t mask = file_table_capacity - 1;
+	size_t i = f->hash & mask;
+	while (file_table[i] && file_table[i] != TOMBSTONE)
+		i = (i + 1) & mask;
+
+	if (!file_table[i])
+		++file_table_used;
+	file_table[i] = f;
+	++file_table_count;
+}
+
+static void unlink_file(struct file *f) {
+	size_t mask = file_table_capacity - 1;
+	size_t i = f->hash & mask;
+	while (file_table[i] != f)
+		i = (i + 1) & mask;
+
+	file_table[i] = TOMBSTONE;
+	--file_table_count;
 }
 
 static void remove_file(struct file *f) {
-	// free file blocks
-	struct block *last_block = NULL;
-	for_each_block(f->block_list, b) {
-		free(b->memory);
-		if (b->prev)
-			free(b->prev);
-
-		last_block = b;
-	}
-	free(last_block);
-	free((void *)f->name);
-
-	// fix file list connections
-	if (f->next)
-		f->next->prev = f->prev;
-	
-	if (f->prev)
-		f->prev->next = f->next;
-	
-
-	if (file_list == f)
-		file_list = f->next;
-	
+	// deleted file was unlinked already
+	if (!f->to_del)
+		unlink_file(f);
+	else
+		__atomic_sub_fetch(&deleted_file_count, 1, __ATOMIC_RELAXED);
+
+	free_file(f);
+}
+
+static struct file *new_file(const char *name, int shift) {
+	struct file *f = (struct file *) malloc(sizeof(struct file));
+	*f = (struct file) {
+		.extents = NULL,
+		.num_extents = 0,
+		.extent_capacity = 0,
+		.block_shift = shift,
+		.name = alloc_name(name),
+		.hash = hash_name(name),
+		.ino = next_ino++,
+		.refs = 0,
+		.size = 0,
+		.generation = 0,
+		.pins = 0,
+		.retired = NULL,
+		.num_retired = 0,
+		.num_packed = 0,
+		.to_del = false,
+		.inlined = true,
+	};
+	pthread_rwlock_init(&f->lock, NULL);
+	return f;
+}
+
+/**
+ * Copies the name into the arena. Called under the exclusive
+ * lock of the file table, so only frees can run along.
+ */
+static const char *alloc_name(const char *name) {
+	size_t len = strlen(name) + 1;
+	if (len > MAX_ARENA_NAME)
+		return strdup(name);
+
+	if (!name_chunk || NAME_CHUNK_SIZE - name_chunk->used < len) {
+		struct name_chunk *old = name_chunk;
+
+		name_chunk = aligned_alloc(NAME_CHUNK_SIZE, NAME_CHUNK_SIZE);
+		*name_chunk = (struct name_chunk) {
+			.live = 0,
+			.used = sizeof(struct name_chunk),
+		};
+
+		// names of the old chunk could be all freed already
+		if (old && !__atomic_load_n(&old->live, __ATOMIC_ACQUIRE))
+			free(old);
+	}
+
+	char *res = (char *) name_chunk + name_chunk->used;
+	memcpy(res, name, len);
+	name_chunk->used += len;
+	__atomic_add_fetch(&name_chunk->live, 1, __ATOMIC_RELAXED);
+
+	return res;
+}
+
+static void free_name(const char *name) {
+	if (strlen(name) + 1 > MAX_ARENA_NAME) {
+		free((void *) name);
+		return;
+	}
+
+	struct name_chunk *chunk = (struct name_chunk *)
+		((uintptr_t) name & ~(uintptr_t) (NAME_CHUNK_SIZE - 1));
+
+	if (!__atomic_sub_fetch(&chunk->live, 1, __ATOMIC_ACQ_REL) && chunk != name_chunk)
+		free(chunk);
+}
+
+/**
+ * Moves data of an inline file to its first extent. 0 on
+ * success, -1 if no memory.
+ */
+static int promote_inline(struct file *f) {
+	if (f->size) {
+		if (!fill_hole(f, 0))
+			return -1;
+		memcpy(f->extents[0].memory, f->inline_data, f->size);
+	}
+
+	// borrowed inline data stays in place, cursors go away
+	f->inlined = false;
+	++f->generation;
+	return 0;
+}
+
+static void free_file(struct file *f) {
+	// free file extents
+	truncate_extents(f, 0);
+	free(f->extents);
+	free_name(f->name);
+	pthread_rwlock_destroy(&f->lock);
+
 	// free file instance itself
 	free(f);
 }
 
+/** Removes the file from the table, now or on the last close. */
+static void delete_file(struct file *f) {
+	if (f->refs) {
+		// file becomes invisible for opening, but
+		// it still exists in memory until last reference is closed
+		unlink_file(f);
+		__atomic_store_n(&f->to_del, true, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&deleted_file_count, 1, __ATOMIC_RELAXED);
+	} else {
+		remove_file(f);
+	}
+}
+
+/**
+ * Makes a file with the same content, the extents are shared
+ * with the source until one of them is written. The clone is not
+ * in the table.
+ */
+static struct file *clone_file(struct file *src, const char *name) {
+	// the source gets shares for its extents
+	pthread_rwlock_wrlock(&src->lock);
+
+	size_t num_extents = src->size ? extent_of(src, src->size - 1) + 1 : 0;
+	if (num_extents > src->num_extents)
+		num_extents = src->num_extents;
+
+	struct file *f = new_file(name, src->block_shift);
+	f->size = src->size;
+
+	// small data is just copied
+	if (src->inlined) {
+		memcpy(f->inline_data, src->inline_data, INLINE_SIZE);
+		pthread_rwlock_unlock(&src->lock);
+		return f;
+	}
+
+	f->inlined = false;
+	f->extents = malloc(sizeof(struct extent) * (num_extents ? num_extents : 1));
+	f->num_extents = num_extents;
+	f->extent_capacity = num_extents ? num_extents : 1;
+
+	for (size_t idx = 0; idx < num_extents; ++idx) {
+		struct extent *e = &src->extents[idx];
+		if (!e->memory) {
+			f->extents[idx] = *e;
+
+			// compressed data is small, it is just copied
+			if (e->packed) {
+				f->extents[idx].packed = malloc(e->packed_size);
+				memcpy(f->extents[idx].packed, e->packed, e->packed_size);
+				__atomic_add_fetch(&data_bytes, e->packed_size, __ATOMIC_RELAXED);
+				__atomic_add_fetch(&packed_bytes, e->packed_size, __ATOMIC_RELAXED);
+				++f->num_packed;
+			}
+			continue;
+		}
+
+		if (!e->share) {
+			e->share = malloc(sizeof(struct extent_share));
+			*e->share = (struct extent_share) {
+				.refs = 1,
+				.size = extent_size(src, idx),
+				.map = NULL,
+				.map_size = 0,
+			};
+		}
+
+		__atomic_add_fetch(&e->share->refs, 1, __ATOMIC_RELAXED);
+		f->extents[idx] = *e;
+	}
+
+	pthread_rwlock_unlock(&src->lock);
+	return f;
+}
+
+static void free_snapshot(struct snapshot *snap) {
+	for (size_t i = 0; i < snap->count; ++i)
+		free_file(snap->files[i]);
+	free(snap->files);
+	free(snap);
+}
+
 static int verify_fd(int fd) {
 	// check if file descriptor valid
-	if (fd < 0 || fd >= file_descriptor_capacity)
+	if (fd < 0 || fd >= desc_chunk_count * DESC_CHUNK)
 		return UFS_ERR_NO_FILE;
 
-	if (!file_descriptors[fd])
+	if (!descriptor_slot(fd)->file)
 		return UFS_ERR_NO_FILE;
 
 	return UFS_ERR_NO_ERR;
 }
 
-static struct block *add_block(struct file *f) {
-	struct block *new_block = (struct block *) malloc(sizeof(struct block));
-	char *mem = (char *) malloc(sizeof(char) * BLOCK_SIZE);
+/**
+ * Extents 0 .. k - 1 grow from the block size up to
+ * MAX_EXTENT_SIZE, k = log2(MAX_EXTENT_SIZE) - block_shift;
+ * the rest are MAX_EXTENT_SIZE each.
+ */
+static size_t geometric_extents(const struct file *f) {
+	return __builtin_ctz(MAX_EXTENT_SIZE) - f->block_shift;
+}
+
+static size_t extent_size(const struct file *f, size_t idx) {
+	if (idx >= geometric_extents(f))
+		return MAX_EXTENT_SIZE;
+	return (size_t) 1 << (f->block_shift + idx);
+}
+
+static size_t extent_start(const struct file *f, size_t idx) {
+	size_t k = geometric_extents(f);
+	if (idx <= k)
+		return (((size_t) 1 << idx) - 1) << f->block_shift;
+	return ((((size_t) 1 << k) - 1) << f->block_shift) + (idx - k) * MAX_EXTENT_SIZE;
+}
+
+static size_t extent_of(const struct file *f, size_t offset) {
+	size_t k = geometric_extents(f);
+	size_t geometric_end = extent_start(f, k);
+
+	if (offset >= geometric_end)
+		return k + (offset - geometric_end) / MAX_EXTENT_SIZE;
+
+	// start of extent i is (2^i - 1) * block size
+	size_t blocks = (offset >> f->block_shift) + 1;
+	return 63 - __builtin_clzll(blocks);
+}
+
+/**
+ * Gives memory to a hole before a write. Returns the extent
+ * memory, NULL if there is no memory.
+ */
+static char *fill_hole(struct file *f, size_t idx) {
+	size_t size = extent_size(f, idx);
+	char *memory = alloc_data(size);
+	if (!memory)
+		return NULL;
+
+	if (idx >= f->extent_capacity) {
+		while (idx >= f->extent_capacity)
+			f->extent_capacity = f->extent_capacity ? f->extent_capacity * 2 : 4;
+		f->extents = realloc(f->extents, sizeof(struct extent) * f->extent_capacity);
+	}
+
+	for (; f->num_extents <= idx; ++f->num_extents)
+		f->extents[f->num_extents] = (struct extent) {.memory = NULL, .share = NULL};
+
+	// the file part of the hole reads as zeros, the rest is
+	// garbage until the file grows over it
+	size_t start = extent_start(f, idx);
+	if (f->size > start)
+		memset(memory, 0, f->size - start < size ? f->size - start : size);
 
-	*new_block = (struct block) {
-		.memory = mem,
-		.prev = NULL,
-		.next = NULL,
-		.occupied = 0,
+	f->extents[idx] = (struct extent) {
+		.memory = memory,
+		.share = NULL,
+		.stamp = access_time(),
 	};
 
-	if (!f->block_list) {
-		f->block_list = new_block;	
-		f->last_block = new_block;
-	} else {
-		f->last_block->next = new_block;
-		new_block->prev = f->last_block;
-		f->last_block = new_block;
+	return memory;
+}
+
+static void truncate_extents(struct file *f, size_t num_extents) {
+	while (f->num_extents > num_extents) {
+		--f->num_extents;
+		if (f->extents[f->num_extents].packed)
+			--f->num_packed;
+		drop_extent(&f->extents[f->num_extents], extent_size(f, f->num_extents));
 	}
 
-	return new_block;
+	// nothing is borrowed when extents are truncated
+	drop_retired(f);
+}
+
+/** Frees copies replaced while the file was pinned. */
+static void drop_retired(struct file *f) {
+	for (size_t i = 0; i < f->num_retired; ++i)
+		drop_extent(&f->retired[i], f->retired[i].share->size);
+	free(f->retired);
+	f->retired = NULL;
+	f->num_retired = 0;
 }
 
-static int push_descriptor(struct filedesc *desc) {
-	int available_fd = -1;
+/** Frees the extent memory, unless other files share it. */
+static void drop_extent(struct extent *e, size_t size) {
+	if (e->packed) {
+		free(e->packed);
+		__atomic_sub_fetch(&data_bytes, e->packed_size, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&packed_bytes, e->packed_size, __ATOMIC_RELAXED);
+		return;
+	}
+
+	if (!e->memory)
+		return;
+
+	if (!e->share) {
+		free_data(e->memory, size);
+		return;
+	}
 
-	if (!file_descriptor_capacity) {
-		file_descriptors = realloc(file_descriptors,
-									sizeof(struct filedesc *) * (++file_descriptor_capacity));
-		file_descriptors[0] = NULL;
+	if (!__atomic_sub_fetch(&e->share->refs, 1, __ATOMIC_ACQ_REL)) {
+		if (e->share->map) {
+			munmap(e->share->map, e->share->map_size);
+			__atomic_sub_fetch(&mapped_bytes, e->share->map_size, __ATOMIC_RELAXED);
+		} else {
+			free_data(e->memory, size);
+		}
+		free(e->share);
 	}
+}
+
+/**
+ * Allocates memory for file data, unless it goes over the limit.
+ * NULL if there is no memory.
+ */
+static char *alloc_data(size_t size) {
+	// the memory is reserved before the allocation, so threads
+	// can't go over the limit together
+	size_t total = __atomic_add_fetch(&data_bytes, size, __ATOMIC_RELAXED);
+	size_t limit = __atomic_load_n(&memory_limit, __ATOMIC_RELAXED);
+
+	char *memory = NULL;
+	if (!limit || total <= limit || ignore_memory_limit)
+		memory = (char *) slab_alloc(size);
+
+	if (!memory)
+		__atomic_sub_fetch(&data_bytes, size, __ATOMIC_RELAXED);
+	return memory;
+}
+
+static void free_data(char *memory, size_t size) {
+	slab_free(memory, size);
+	__atomic_sub_fetch(&data_bytes, size, __ATOMIC_RELAXED);
+}
+
+static uint32_t access_time(void) {
+	return __atomic_load_n(&access_clock, __ATOMIC_RELAXED);
+}
+
+/**
+ * Compresses extents of the file idle for @a idle ticks. Returns
+ * how many were compressed.
+ */
+static int pack_cold_extents(struct file *f, uint32_t now, uint32_t idle) {
+	int count = 0;
+	pthread_rwlock_wrlock(&f->lock);
+
+	// borrowed memory must stay in place
+	if (!f->inlined && !file_pinned(f) && f->size) {
+		size_t num_extents = extent_of(f, f->size - 1) + 1;
+		if (num_extents > f->num_extents)
+			num_extents = f->num_extents;
+
+		for (size_t idx = 0; idx < num_extents; ++idx) {
+			struct extent *e = &f->extents[idx];
+			if (e->memory && now - e->stamp >= idle && !pack_extent(f, idx))
+				++count;
+		}
 
-	for (int i = file_descriptor_capacity - 1; i >= 0; --i) {
-		if (!file_descriptors[i])
-			available_fd = i;
+		// cursors can point to the freed memory
+		if (count)
+			++f->generation;
 	}
 
-	if (available_fd != -1)
-		goto end;
+	pthread_rwlock_unlock(&f->lock);
+	return count;
+}
 
-	// in other case create new descriptor
-	// and add it to the end of the list
-	file_descriptors = realloc(file_descriptors,
-								sizeof(struct filedesc *) * (++file_descriptor_capacity));
-	available_fd = file_descriptor_capacity - 1;
+/**
+ * Replaces the extent memory with its compressed file part. 0 on
+ * success, -1 if the extent is shared or does not compress well.
+ */
+static int pack_extent(struct file *f, size_t idx) {
+	struct extent *e = &f->extents[idx];
+
+	// the last owner of a share can pack it, an image can't be
+	// unmapped in parts
+	if (e->share && (e->share->map || __atomic_load_n(&e->share->refs, __ATOMIC_RELAXED) > 1))
+		return -1;
+
+	size_t size = extent_size(f, idx);
+	size_t start = extent_start(f, idx);
+	size_t used = f->size - start < size ? f->size - start : size;
+
+	// it is worth it if a quarter is saved at least
+	size_t capacity = used - used / 4;
+	char *packed = malloc(capacity ? capacity : 1);
+	size_t packed_size = lz_compress(e->memory, used, packed, capacity);
+	if (!packed_size) {
+		free(packed);
+		return -1;
+	}
 
-end:
-	++file_descriptor_count;
-	file_descriptors[available_fd] = desc;
-	return available_fd;
+	__atomic_add_fetch(&data_bytes, packed_size, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&packed_bytes, packed_size, __ATOMIC_RELAXED);
+
+	uint32_t stamp = e->stamp;
+	drop_extent(e, size);
+	*e = (struct extent) {
+		.memory = NULL,
+		.share = NULL,
+		.packed = realloc(packed, packed_size),
+		.packed_size = packed_size,
+		.stamp = stamp,
+	};
+	++f->num_packed;
+	return 0;
 }
 
-static void fix_offset(struct filedesc *fd) {
-	int file_offset = fd->file->size;
+/**
+ * Gives the compressed extent its memory back. 0 on success, -1
+ * if there is no memory.
+ */
+static int unpack_extent(struct file *f, size_t idx) {
+	struct extent *e = &f->extents[idx];
+	size_t size = extent_size(f, idx);
+
+	// the data is in memory already, so the limit does not apply
+	char *memory = (char *) slab_alloc(size);
+	if (!memory)
+		return -1;
+	__atomic_add_fetch(&data_bytes, size, __ATOMIC_RELAXED);
+
+	ptrdiff_t used = lz_decompress(e->packed, e->packed_size, memory, size);
+	if (used < 0) {
+		free_data(memory, size);
+		return -1;
+	}
 
-	if (fd->offset > file_offset)
-		fd->offset = file_offset;
-}
\ No newline at end of file
+	// the rest was behind the file end when it was packed
+	memset(memory + used, 0, size - used);
+
+	drop_extent(e, size);
+	*e = (struct extent) {
+		.memory = memory,
+		.share = NULL,
+		.stamp = access_time(),
+	};
+	--f->num_packed;
+	return 0;
+}
+
+/** Tells if any extent the range touches is compressed. */
+static bool has_packed(const struct file *f, size_t offset, size_t size) {
+	if (!f->num_packed || !size || offset >= MAX_FILE_SIZE)
+		return false;
+
+	size_t end = size < MAX_FILE_SIZE - offset ? offset + size : MAX_FILE_SIZE;
+	for (size_t idx = extent_of(f, offset);
+	     idx < f->num_extents && extent_start(f, idx) < end; ++idx) {
+		if (f->extents[idx].packed)
+			return true;
+	}
+	return false;
+}
+
+/**
+ * Decompresses extents the range touches. 0 on success, -1 if
+ * there is no memory.
+ */
+static int unpack_range(struct file *f, size_t offset, size_t size) {
+	if (!has_packed(f, offset, size))
+		return 0;
+
+	size_t end = size < MAX_FILE_SIZE - offset ? offset + size : MAX_FILE_SIZE;
+	for (size_t idx = extent_of(f, offset);
+	     idx < f->num_extents && extent_start(f, idx) < end; ++idx) {
+		if (f->extents[idx].packed && unpack_extent(f, idx))
+			return -1;
+	}
+	return 0;
+}
+
+/**
+ * Takes the read lock of the file with the range decompressed. It
+ * is decompressed under the write lock, and then it can be packed
+ * again before the read lock is taken, so it is checked in a loop.
+ * 0 on success, -1 if there is no memory, the lock is not taken.
+ */
+static int rdlock_unpacked(struct file *f, size_t offset, size_t size) {
+	pthread_rwlock_rdlock(&f->lock);
+
+	while (has_packed(f, offset, size)) {
+		pthread_rwlock_unlock(&f->lock);
+
+		pthread_rwlock_wrlock(&f->lock);
+		int rc = unpack_range(f, offset, size);
+		pthread_rwlock_unlock(&f->lock);
+		if (rc)
+			return -1;
+
+		pthread_rwlock_rdlock(&f->lock);
+	}
+
+	return 0;
+}
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void op_timer_stop(struct op_timer *t) {
+	uint64_t ns = now_ns() - t->start;
+	struct ufs_op_stats *st = &op_stats[t->op];
+
+	__atomic_add_fetch(&st->count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&st->total_ns, ns, __ATOMIC_RELAXED);
+
+	uint64_t max = __atomic_load_n(&st->max_ns, __ATOMIC_RELAXED);
+	while (ns > max && !__atomic_compare_exchange_n(&st->max_ns, &max, ns, true,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/**
+ * Gives the file its own copy of a shared extent before a write.
+ * Returns the extent memory, NULL if there is no memory.
+ */
+static char *unshare_extent(struct file *f, size_t idx) {
+	struct extent *e = &f->extents[idx];
+	size_t size = extent_size(f, idx);
+
+	char *memory = alloc_data(size);
+	if (!memory)
+		return NULL;
+
+	// only the file part is worth copying, the rest is
+	// zeroed or overwritten before it is read
+	size_t start = extent_start(f, idx);
+	size_t used = f->size > start ? f->size - start : 0;
+	memcpy(memory, e->memory, used < size ? used : size);
+
+	if (file_pinned(f)) {
+		f->retired = realloc(f->retired, sizeof(struct extent) * (f->num_retired + 1));
+		f->retired[f->num_retired++] = *e;
+	} else {
+		drop_extent(e, size);
+	}
+
+	*e = (struct extent) {
+		.memory = memory,
+		.share = NULL,
+		.stamp = access_time(),
+	};
+
+	// cursors of other descriptors point to the old memory
+	++f->generation;
+	return memory;
+}
+
+/** Opened descriptor by its number, NULL if there is none. */
+static struct filedesc *get_descriptor(int fd) {
+	pthread_rwlock_rdlock(&descriptors_lock);
+	struct filedesc *desc = verify_fd(fd) ? NULL : descriptor_slot(fd);
+	pthread_rwlock_unlock(&descriptors_lock);
+	return desc;
+}
+
+static struct filedesc *descriptor_slot(int fd) {
+	return &desc_chunks[fd / DESC_CHUNK][fd % DESC_CHUNK];
+}
+
+static void resize_desc_index(int capacity) {
+	desc_chunk_capacity = capacity;
+	desc_chunks = realloc(desc_chunks, sizeof(struct filedesc *) * capacity);
+	desc_free = realloc(desc_free, sizeof(uint64_t) * capacity);
+}
+
+/** Takes the lowest free descriptor, the caller fills it. */
+static int alloc_descriptor(void) {
+	int chunk = desc_first_free;
+	while (chunk < desc_chunk_count && !desc_free[chunk])
+		++chunk;
+
+	if (chunk == desc_chunk_count) {
+		if (desc_chunk_count == desc_chunk_capacity)
+			resize_desc_index(desc_chunk_capacity ? desc_chunk_capacity * 2 : 4);
+
+		desc_chunks[chunk] = calloc(DESC_CHUNK, sizeof(struct filedesc));
+		desc_free[chunk] = ~(uint64_t) 0;
+		++desc_chunk_count;
+	}
+
+	desc_first_free = chunk;
+
+	int slot = __builtin_ctzll(desc_free[chunk]);
+	desc_free[chunk] &= ~((uint64_t) 1 << slot);
+	++file_descriptor_count;
+
+	return chunk * DESC_CHUNK + slot;
+}
+
+static void free_descriptor(int fd) {
+	int chunk = fd / DESC_CHUNK;
+	int slot = fd % DESC_CHUNK;
+
+	desc_chunks[chunk][slot].file = NULL;
+	desc_free[chunk] |= (uint64_t) 1 << slot;
+	--file_descriptor_count;
+
+	if (chunk < desc_first_free)
+		desc_first_free = chunk;
+
+	// one empty chunk is kept at the end, so opening and closing
+	// around a chunk border does not allocate every time
+	while (desc_chunk_count >= 2 && !~desc_free[desc_chunk_count - 1]
+	       && !~desc_free[desc_chunk_count - 2])
+		free(desc_chunks[--desc_chunk_count]);
+
+	if (desc_first_free > desc_chunk_count)
+		desc_first_free = desc_chunk_count;
+
+	// the index shrinks only when it is a quarter full
+	if (desc_chunk_capacity > 4 && desc_chunk_count * 4 <= desc_chunk_capacity)
+		resize_desc_index(desc_chunk_capacity / 2);
+}
+
+static void fix_offset(struct filedesc *fd) {
+	size_t file_offset = fd->file->size;
+
+	if (fd->offset > file_offset)
+		fd->offset = file_offset;
+}
+
+/** Drops the cursor if the file was truncated since it was set. */
+static void sync_cursor(struct filedesc *fd) {
+	if (fd->cursor.generation == fd->file->generation)
+		return;
+
+	fix_offset(fd);
+	fd->cursor.generation = fd->file->generation;
+	fd->cursor.memory = NULL;
+	fd->cursor.end = 0;
+}
+
+/**
+ * Moves the cursor to the offset and returns its byte in the file
+ * memory, NULL if the offset is in a hole.
+ */
+static char *seek_cursor(struct file *f, struct cursor *c, size_t offset) {
+	if (f->inlined) {
+		// the inline data is the only extent
+		c->idx = 0;
+		c->start = 0;
+		c->end = INLINE_SIZE;
+		c->memory = f->inline_data;
+		return f->inline_data + offset;
+	}
+
+	if (!c->end || offset < c->start || offset >= c->end) {
+		// sequential access just steps to the next extent
+		size_t idx;
+		if (c->end && offset == c->end)
+			idx = c->idx + 1;
+		else
+			idx = extent_of(f, offset);
+
+		c->idx = idx;
+		c->start = extent_start(f, idx);
+		c->end = c->start + extent_size(f, idx);
+		c->memory = NULL;
+	}
+
+	if (c->idx < f->num_extents) {
+		struct extent *e = &f->extents[c->idx];
+
+		// readers go in parallel, the stamp is written only when
+		// the clock ticked since the last access
+		uint32_t now = access_time();
+		if (__atomic_load_n(&e->stamp, __ATOMIC_RELAXED) != now)
+			__atomic_store_n(&e->stamp, now, __ATOMIC_RELAXED);
+
+		// a hole could be written through another descriptor
+		if (!c->memory)
+			c->memory = e->memory;
+	}
+
+	return c->memory ? c->memory + (offset - c->start) : NULL;
+}
+
+/**
+ * Extends the file with zeros, the new part is a hole. 0 on
+ * success, -1 if no memory.
+ */
+static int grow_file(struct file *f, size_t new_size) {
+	if (f->inlined) {
+		if (new_size > INLINE_SIZE && promote_inline(f))
+			return -1;
+
+		// truncated bytes are zeroed here, they could be borrowed
+		if (f->inlined) {
+			memset(f->inline_data + f->size, 0, new_size - f->size);
+			f->size = new_size;
+			return 0;
+		}
+	}
+
+	size_t num_extents = extent_of(f, new_size - 1) + 1;
+
+	// bytes behind the old end are garbage: in its extent, and
+	// in extents kept after a truncation for borrows
+	size_t kept = f->num_extents < num_extents ? f->num_extents : num_extents;
+	for (size_t idx = extent_of(f, f->size); idx < kept; ++idx) {
+		if (f->extents[idx].packed && unpack_extent(f, idx))
+			return -1;
+
+		char *memory = f->extents[idx].memory;
+		if (!memory)
+			continue;
+		if (f->extents[idx].share && !(memory = unshare_extent(f, idx)))
+			return -1;
+
+		size_t start = extent_start(f, idx);
+		size_t from = f->size > start ? f->size - start : 0;
+		memset(memory + from, 0, extent_size(f, idx) - from);
+	}
+
+	f->size = new_size;
+	return 0;
+}
+
+/** Cuts the file, the memory can be kept for borrows. */
+static void shrink_file(struct file *f, size_t new_size) {
+	f->size = new_size;
+	// borrowed memory is freed after the last release
+	if (!file_pinned(f))
+		trim_extents(f);
+	// cursors can point behind the end
+	++f->generation;
+}
+
+/** Frees extents behind the file end and retired ones. */
+static void trim_extents(struct file *f) {
+	// retired copies go even if the size did not change
+	drop_retired(f);
+
+	// one drop of the whole index range, holes cost nothing
+	size_t num_extents = f->size ? extent_of(f, f->size - 1) + 1 : 0;
+	if (f->num_extents <= num_extents)
+		return;
+
+	truncate_extents(f, num_extents);
+	++f->generation;
+}
+
+/**
+ * Tells if the file memory is borrowed. Borrows come under the
+ * read lock, so even the write lock holder reads it atomically.
+ */
+static bool file_pinned(struct file *f) {
+	return __atomic_load_n(&f->pins, __ATOMIC_ACQUIRE) != 0;
+}
+
+/**
+ * Drops borrows of the file memory. The last one frees extents
+ * left by truncations which happened meanwhile.
+ */
+static void unpin_file(struct file *f, int pins) {
+	if (__atomic_sub_fetch(&f->pins, pins, __ATOMIC_ACQ_REL))
+		return;
+
+	pthread_rwlock_wrlock(&f->lock);
+	// a new borrow could come before the lock
+	if (!file_pinned(f))
+		trim_extents(f);
+	pthread_rwlock_unlock(&f->lock);
+}
+
+/**
+ * Copies the buffers into the file from the offset on, the file
+ * grows if needed. The cursor is moved along. Returns how many
+ * bytes were written, it is less than asked only if there is no
+ * memory or the file reached its max size.
+ */
+static size_t file_write_at(struct file *f, struct cursor *c, size_t offset,
+			    const struct iovec *iov, int iovcnt) {
+	size_t done = 0;
+
+	if (f->inlined && offset + iov_size(iov, iovcnt) > INLINE_SIZE) {
+		if (promote_inline(f))
+			return 0;
+		c->end = 0;
+	}
+
+	// compressed extents would be taken for holes
+	if (unpack_range(f, offset, iov_size(iov, iovcnt)))
+		return 0;
+
+	for (int i = 0; i < iovcnt; ++i) {
+		const char *buf = iov[i].iov_base;
+		size_t left = iov[i].iov_len;
+
+		while (left) {
+			char *dst = seek_cursor(f, c, offset);
+			if (!dst || (!f->inlined && f->extents[c->idx].share)) {
+				c->memory = dst ? unshare_extent(f, c->idx) : fill_hole(f, c->idx);
+				if (!c->memory)
+					return done;
+				dst = c->memory + (offset - c->start);
+			}
+
+			size_t to_write = c->end - offset;
+			if (to_write > left)
+				to_write = left;
+
+			if (offset + to_write > MAX_FILE_SIZE)
+				to_write = MAX_FILE_SIZE - offset;
+
+			if (!to_write)
+				return done;
+
+			memcpy(dst, buf, to_write);
+
+			offset += to_write;
+			f->size = offset > f->size ? offset : f->size;
+			buf += to_write;
+			left -= to_write;
+			done += to_write;
+		}
+	}
+
+	return done;
+}
+
+/**
+ * Copies the file from the offset into the buffers, up to the
+ * file end. The cursor is moved along. Returns how many bytes
+ * were read.
+ */
+static size_t file_read_at(struct file *f, struct cursor *c, size_t offset,
+			   const struct iovec *iov, int iovcnt) {
+	size_t done = 0;
+
+	for (int i = 0; i < iovcnt && offset < f->size; ++i) {
+		char *buf = iov[i].iov_base;
+		size_t left = iov[i].iov_len;
+
+		while (left && offset < f->size) {
+			char *src = seek_cursor(f, c, offset);
+
+			size_t to_read = c->end - offset;
+			if (to_read > left)
+				to_read = left;
+
+			if (to_read > f->size - offset)
+				to_read = f->size - offset;
+
+			if (src)
+				memcpy(buf, src, to_read);
+			else
+				memset(buf, 0, to_read);
+
+			offset += to_read;
+			buf += to_read;
+			left -= to_read;
+			done += to_read;
+		}
+	}
+
+	return done;
+}
+
+static size_t iov_size(const struct iovec *iov, int iovcnt) {
+	size_t size = 0;
+	for (int i = 0; i < iovcnt; ++i)
+		size += iov[i].iov_len;
+	return size;
+}
+
+static size_t align_up(size_t size, size_t align) {
+	return (size + align - 1) & ~(align - 1);
+}
+
+static char *path_with_suffix(const char *path, const char *suffix) {
+	size_t len = strlen(path);
+	char *res = malloc(len + strlen(suffix) + 1);
+	memcpy(res, path, len);
+	strcpy(res + len, suffix);
+	return res;
+}
+
+static int write_all(int fd, const void *data, size_t size) {
+	const char *p = data;
+	while (size) {
+		ssize_t n = write(fd, p, size);
+		if (n < 0)
+			return -1;
+		p += n;
+		size -= n;
+	}
+	return 0;
+}
+
+/**
+ * Appends a record to the journal. If it can't be written whole,
+ * the journal is cut back to the previous record and stopped. 0 on
+ * success or if there is no journal, -1 on error.
+ */
+static int journal_append(uint32_t op, uint64_t ino, uint64_t arg, const char *name,
+			  const void *data, size_t len) {
+	pthread_mutex_lock(&journal_lock);
+	if (journal_fd == -1) {
+		pthread_mutex_unlock(&journal_lock);
+		return 0;
+	}
+
+	struct journal_record rec = {
+		.op = op,
+		.name_len = name ? strlen(name) : 0,
+		.ino = ino,
+		.arg = arg,
+		.len = len,
+	};
+	struct iovec iov[3] = {
+		{.iov_base = &rec, .iov_len = sizeof(rec)},
+		{.iov_base = (char *) name, .iov_len = rec.name_len},
+		{.iov_base = (void *) data, .iov_len = len},
+	};
+
+	struct iovec *left = iov;
+	int cnt = 3;
+	off_t start = lseek(journal_fd, 0, SEEK_END);
+	int rc = start == -1 ? -1 : 0;
+
+	// a short write is continued, an interrupted one retried
+	while (!rc && cnt) {
+		ssize_t n = writev(journal_fd, left, cnt);
+		if (n < 0) {
+			if (errno != EINTR)
+				rc = -1;
+			continue;
+		}
+
+		for (; cnt && (size_t) n >= left->iov_len; --cnt, ++left)
+			n -= left->iov_len;
+		if (cnt) {
+			left->iov_base = (char *) left->iov_base + n;
+			left->iov_len -= n;
+		}
+	}
+
+	// next records would follow a torn one, and replay stops on it
+	if (rc) {
+		if (start != -1 && ftruncate(journal_fd, start))
+			perror("journal");
+		close(journal_fd);
+		journal_fd = -1;
+	}
+
+	pthread_mutex_unlock(&journal_lock);
+	return rc;
+}
+
+/**
+ * Journals the first @a size bytes of a write at the offset. 0 on
+ * success, -1 on error.
+ */
+static int journal_write(struct file *f, size_t offset, const struct iovec *iov,
+			 int iovcnt, size_t size) {
+	// deleted files are not in the image, nothing to replay
+	if (__atomic_load_n(&f->to_del, __ATOMIC_RELAXED))
+		return 0;
+
+	for (int i = 0; i < iovcnt && size; ++i) {
+		size_t len = iov[i].iov_len < size ? iov[i].iov_len : size;
+		if (len && journal_append(JOURNAL_WRITE, f->ino, offset, NULL, iov[i].iov_base, len))
+			return -1;
+		offset += len;
+		size -= len;
+	}
+	return 0;
+}
+
+/**
+ * Writes @a len bytes of a compressed extent. The data is
+ * decompressed into @a buf, it is allocated on the first call.
+ * 0 on success, -1 on error.
+ */
+static int write_packed(int fd, const struct extent *e, size_t len, char **buf) {
+	if (!*buf && !(*buf = malloc(MAX_EXTENT_SIZE)))
+		return -1;
+
+	ptrdiff_t used = lz_decompress(e->packed, e->packed_size, *buf, MAX_EXTENT_SIZE);
+	if (used < 0)
+		return -1;
+
+	if ((size_t) used < len)
+		memset(*buf + used, 0, len - used);
+	return write_all(fd, *buf, len);
+}
+
+/** Writes all the files to the image. 0 on success, -1 on error. */
+static int save_image(const char *path) {
+	// files stay read-locked until the journal is cut, so no
+	// write gets lost between the image and the journal
+	struct file **files = malloc(sizeof(struct file *) * (file_table_count + 1));
+	size_t count = 0;
+	for (size_t i = 0; i < file_table_capacity; ++i) {
+		struct file *f = file_table[i];
+		if (f && f != TOMBSTONE) {
+			pthread_rwlock_rdlock(&f->lock);
+			files[count++] = f;
+		}
+	}
+
+	size_t meta = sizeof(struct image_header);
+	for (size_t i = 0; i < count; ++i)
+		meta += align_up(sizeof(struct image_file) + strlen(files[i]->name), 8);
+
+	char *buf = calloc(1, meta);
+	struct image_header *h = (struct image_header *) buf;
+	memcpy(h->magic, IMAGE_MAGIC, sizeof(h->magic));
+	h->count = count;
+	h->next_ino = next_ino;
+
+	size_t pos = sizeof(struct image_header);
+	size_t data = align_up(meta, IMAGE_ALIGN);
+	for (size_t i = 0; i < count; ++i) {
+		struct file *f = files[i];
+		struct image_file *r = (struct image_file *) (buf + pos);
+		*r = (struct image_file) {
+			.ino = f->ino,
+			.size = f->size,
+			.data = data,
+			.name_len = strlen(f->name),
+			.block_shift = f->block_shift,
+		};
+		memcpy(r + 1, f->name, r->name_len);
+
+		pos += align_up(sizeof(struct image_file) + r->name_len, 8);
+		data = align_up(data + f->size, IMAGE_ALIGN);
+	}
+
+	// the old image stays whole until the new one is complete
+	char *tmp = path_with_suffix(path, ".tmp");
+
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	int rc = fd == -1 ? -1 : write_all(fd, buf, meta);
+
+	static const char zeros[IMAGE_ALIGN];
+	char *unpacked = NULL;
+	pos = meta;
+	for (size_t i = 0; i < count && !rc; ++i) {
+		struct file *f = files[i];
+
+		size_t pad = align_up(pos, IMAGE_ALIGN) - pos;
+		rc = write_all(fd, zeros, pad);
+		pos += pad;
+
+		for (size_t idx = 0; !rc && extent_start(f, idx) < f->size; ++idx) {
+			size_t len = f->size - extent_start(f, idx);
+			if (len > extent_size(f, idx))
+				len = extent_size(f, idx);
+
+			// holes stay holes in the image
+			if (f->inlined)
+				rc = write_all(fd, f->inline_data, len);
+			else if (idx < f->num_extents && f->extents[idx].memory)
+				rc = write_all(fd, f->extents[idx].memory, len);
+			else if (idx < f->num_extents && f->extents[idx].packed)
+				rc = write_packed(fd, &f->extents[idx], len, &unpacked);
+			else if (lseek(fd, len, SEEK_CUR) == -1)
+				rc = -1;
+		}
+		pos += f->size;
+	}
+
+	// the image can end with a hole
+	if (!rc)
+		rc = ftruncate(fd, pos);
+
+	if (fd != -1) {
+		if (!rc)
+			rc = fsync(fd);
+		if (close(fd))
+			rc = -1;
+	}
+
+	if (!rc)
+		rc = rename(tmp, path);
+	if (rc && fd != -1)
+		unlink(tmp);
+
+	// the image has everything the journal had. It is cut even if
+	// journaling is off, or old records would be replayed over the
+	// new image. A journal stopped on an error stays off
+	if (!rc) {
+		char *journal = path_with_suffix(path, ".journal");
+		pthread_mutex_lock(&journal_lock);
+		if (truncate(journal, 0) && errno != ENOENT)
+			rc = -1;
+		pthread_mutex_unlock(&journal_lock);
+		free(journal);
+	}
+
+	for (size_t i = 0; i < count; ++i)
+		pthread_rwlock_unlock(&files[i]->lock);
+
+	free(unpacked);
+	free(tmp);
+	free(buf);
+	free(files);
+	return rc;
+}
+
+/** Files of the image by their numbers, for journal replay. */
+struct ino_entry {
+	uint64_t ino;
+	/** NULL if the file was deleted. */
+	struct file *file;
+};
+
+struct ino_map {
+	struct ino_entry *entries;
+	size_t count;
+	size_t capacity;
+};
+
+static struct ino_entry *ino_map_find(struct ino_map *m, uint64_t ino) {
+	size_t lo = 0, hi = m->count;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (m->entries[mid].ino < ino)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < m->count && m->entries[lo].ino == ino ? &m->entries[lo] : NULL;
+}
+
+static void ino_map_add(struct ino_map *m, struct file *f) {
+	if (m->count == m->capacity) {
+		m->capacity = m->capacity ? m->capacity * 2 : 16;
+		m->entries = realloc(m->entries, sizeof(struct ino_entry) * m->capacity);
+	}
+
+	// numbers mostly come in order, so it is an append
+	size_t i = m->count;
+	while (i > 0 && m->entries[i - 1].ino > f->ino)
+		--i;
+	memmove(&m->entries[i + 1], &m->entries[i], sizeof(struct ino_entry) * (m->count - i));
+	m->entries[i] = (struct ino_entry) {.ino = f->ino, .file = f};
+	++m->count;
+
+	if (f->ino >= next_ino)
+		next_ino = f->ino + 1;
+}
+
+static void replay_delete(struct ino_map *m, struct file *f) {
+	struct ino_entry *e = ino_map_find(m, f->ino);
+	if (e)
+		e->file = NULL;
+	delete_file(f);
+}
+
+static void replay_record(struct ino_map *m, const struct journal_record *rec,
+			  const char *name, const char *data) {
+	struct ino_entry *e = ino_map_find(m, rec->ino);
+	struct file *f = e ? e->file : NULL;
+	char *fname = strndup(name, rec->name_len);
+
+	switch (rec->op) {
+	case JOURNAL_CREATE: {
+		struct file *old = find_file(fname);
+		if (old)
+			replay_delete(m, old);
+
+		int shift = rec->arg >= __builtin_ctz(MIN_BLOCK_SIZE)
+			    && rec->arg <= __builtin_ctz(MAX_EXTENT_SIZE) ? (int) rec->arg : block_shift;
+		f = new_file(fname, shift);
+		f->ino = rec->ino;
+		add_file(f);
+		ino_map_add(m, f);
+		break;
+	}
+	case JOURNAL_WRITE: {
+		if (!f || rec->arg >= MAX_FILE_SIZE)
+			break;
+		if (rec->arg > f->size && grow_file(f, rec->arg))
+			break;
+
+		struct iovec iov = {.iov_base = (char *) data, .iov_len = rec->len};
+		struct cursor c = {.memory = NULL};
+		file_write_at(f, &c, rec->arg, &iov, 1);
+		break;
+	}
+	case JOURNAL_RESIZE:
+		if (!f || rec->arg >= MAX_FILE_SIZE)
+			break;
+		if (rec->arg > f->size)
+			grow_file(f, rec->arg);
+		else
+			shrink_file(f, rec->arg);
+		break;
+	case JOURNAL_DELETE:
+		if (f)
+			replay_delete(m, f);
+		break;
+	case JOURNAL_CLONE: {
+		if (!f)
+			break;
+
+		struct file *old = find_file(fname);
+		if (old == f)
+			break;
+		if (old)
+			replay_delete(m, old);
+
+		struct file *copy = clone_file(f, fname);
+		copy->ino = rec->arg;
+		add_file(copy);
+		ino_map_add(m, copy);
+		break;
+	}
+	}
+
+	free(fname);
+}
+
+/** Applies the journal of the image, a torn tail is skipped. */
+static void replay_journal(const char *path, struct ino_map *m) {
+	char *journal = path_with_suffix(path, ".journal");
+	int fd = open(journal, O_RDONLY | O_CLOEXEC);
+	free(journal);
+
+	if (fd == -1)
+		return;
+
+	struct stat st;
+	char *map = MAP_FAILED;
+	if (!fstat(fd, &st) && st.st_size > 0)
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED)
+		return;
+
+	size_t size = st.st_size;
+	size_t pos = 0;
+	ignore_memory_limit = true;
+	while (size - pos >= sizeof(struct journal_record)) {
+		// records are not aligned
+		struct journal_record rec;
+		memcpy(&rec, map + pos, sizeof(rec));
+		pos += sizeof(rec);
+
+		if (rec.name_len > size - pos || rec.len > size - pos - rec.name_len)
+			break;
+
+		replay_record(m, &rec, map + pos, map + pos + rec.name_len);
+		pos += rec.name_len + rec.len;
+	}
+	ignore_memory_limit = false;
+
+	munmap(map, size);
+}
+
+/**
+ * Replaces all the files with the ones of the image, their data
+ * is used right from the mapped image until it is written.
+ * Returns an error code.
+ */
+static int load_image(const char *path) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return UFS_ERR_NO_FILE;
+
+	struct stat st;
+	char *map = MAP_FAILED;
+	if (!fstat(fd, &st) && (size_t) st.st_size >= sizeof(struct image_header))
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED)
+		return UFS_ERR_IO;
+
+	size_t map_size = st.st_size;
+	const struct image_header *h = (const struct image_header *) map;
+
+	// the image is checked before the current files are dropped
+	bool broken = memcmp(h->magic, IMAGE_MAGIC, sizeof(h->magic)) != 0;
+	size_t pos = sizeof(struct image_header);
+	for (uint64_t i = 0; i < h->count && !broken; ++i) {
+		const struct image_file *r = (const struct image_file *) (map + pos);
+		broken = map_size - pos < sizeof(struct image_file)
+			 || !r->name_len
+			 || r->name_len > map_size - pos - sizeof(struct image_file)
+			 || r->block_shift < __builtin_ctz(MIN_BLOCK_SIZE)
+			 || r->block_shift > __builtin_ctz(MAX_EXTENT_SIZE)
+			 || r->size >= MAX_FILE_SIZE
+			 || r->data > map_size
+			 || r->size > map_size - r->data;
+		if (!broken)
+			pos += align_up(sizeof(struct image_file) + r->name_len, 8);
+		broken = broken || pos > map_size;
+	}
+
+	if (broken) {
+		munmap(map, map_size);
+		return UFS_ERR_IO;
+	}
+
+	// current files go away as if they were deleted, opened
+	// descriptors keep working with them
+	for (size_t i = 0; i < file_table_capacity; ++i) {
+		struct file *f = file_table[i];
+		if (f && f != TOMBSTONE)
+			delete_file(f);
+	}
+
+	struct extent_share *share = malloc(sizeof(struct extent_share));
+	*share = (struct extent_share) {
+		.refs = 0,
+		.size = 0,
+		.map = map,
+		.map_size = map_size,
+	};
+
+	struct ino_map m = {.entries = NULL, .count = 0, .capacity = 0};
+	if (h->next_ino > next_ino)
+		next_ino = h->next_ino;
+
+	pos = sizeof(struct image_header);
+	for (uint64_t i = 0; i < h->count; ++i) {
+		const struct image_file *r = (const struct image_file *) (map + pos);
+		char *name = strndup((const char *) (r + 1), r->name_len);
+		pos += align_up(sizeof(struct image_file) + r->name_len, 8);
+
+		// a valid image has unique names
+		if (find_file(name)) {
+			free(name);
+			continue;
+		}
+
+		struct file *f = new_file(name, r->block_shift);
+		free(name);
+
+		size_t num_extents = r->size ? extent_of(f, r->size - 1) + 1 : 0;
+		f->ino = r->ino;
+		f->size = r->size;
+
+		if (r->size <= INLINE_SIZE) {
+			memcpy(f->inline_data, map + r->data, r->size);
+			add_file(f);
+			ino_map_add(&m, f);
+			continue;
+		}
+
+		f->inlined = false;
+		f->extents = malloc(sizeof(struct extent) * (num_extents ? num_extents : 1));
+		f->num_extents = num_extents;
+		f->extent_capacity = num_extents ? num_extents : 1;
+
+		for (size_t idx = 0; idx < num_extents; ++idx) {
+			f->extents[idx] = (struct extent) {
+				.memory = map + r->data + extent_start(f, idx),
+				.share = share,
+			};
+			++share->refs;
+		}
+
+		add_file(f);
+		ino_map_add(&m, f);
+	}
+
+	if (!share->refs) {
+		munmap(map, map_size);
+		free(share);
+	} else {
+		__atomic_add_fetch(&mapped_bytes, map_size, __ATOMIC_RELAXED);
+	}
+
+	replay_journal(path, &m);
+	free(m.entries);
+
+	return UFS_ERR_NO_ERR;
+}
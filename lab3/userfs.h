@@ -1,10 +1,19 @@
+#include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 /**
  * User-defined in-memory filesystem. It is as simple as possible.
- * Each file lies in the memory as an array of blocks. A file
- * has an unique file name, and there are no directories, so the
- * FS is a monolithic flat contiguous folder.
+ * Each file lies in the memory as an array of extents, growing
+ * geometrically from the block size. A file has an unique file
+ * name, and there are no directories, so the FS is a monolithic
+ * flat contiguous folder.
+ *
+ * All the functions can be called from many threads. Reads of a
+ * file go in parallel, writes and resize of a file are exclusive,
+ * and files do not block each other. Error codes are per thread.
+ * A single descriptor must not be used by two threads at once,
+ * except for ufs_pread() and ufs_pwrite() which do not move it.
  */
 
 /**
@@ -66,12 +75,25 @@ enum ufs_error_code {
 
 	UFS_ERR_NO_PERMISSION,
 #endif
+
+	UFS_ERR_IO,
 };
 
-/** Get code of the last error. */
+/** Get code of the last error in the calling thread. */
 enum ufs_error_code
 ufs_errno();
 
+/**
+ * Set the block size of files created after the call: size of
+ * their first extent. Every next extent is twice bigger, up to
+ * 1MB. Small block size saves memory on small files, big one
+ * makes less extents in big files.
+ * @param size New block size. It is rounded up to a power of
+ *        two and clamped to [64, 1MB]. Default is 512.
+ */
+void
+ufs_set_block_size(size_t size);
+
 /**
  * Open a file by filename.
  * @param filename Name of a file to open.
@@ -113,6 +135,106 @@ ufs_write(int fd, const char *buf, size_t size);
 ssize_t
 ufs_read(int fd, char *buf, size_t size);
 
+/**
+ * Write data from several buffers to the file, in one call.
+ * @param fd File descriptor from ufs_open().
+ * @param iov Buffers to write, one after another.
+ * @param iovcnt Number of buffers in @a iov.
+ *
+ * @retval >= 0 How many bytes were written.
+ * @retval -1 Error occurred. The same codes as of ufs_write().
+ */
+ssize_t
+ufs_writev(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * Read data from the file into several buffers, in one call.
+ * @param fd File descriptor from ufs_open().
+ * @param iov Buffers to fill, one after another.
+ * @param iovcnt Number of buffers in @a iov.
+ *
+ * @retval >= 0 How many bytes were read, 0 is EOF.
+ * @retval -1 Error occurred. The same codes as of ufs_read().
+ */
+ssize_t
+ufs_readv(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * Write data to the file at the offset. The descriptor position
+ * is not changed, so threads can share the descriptor. If the
+ * offset is behind the file end, the gap reads as zeros; the
+ * file is not grown if nothing is written.
+ * @param fd File descriptor from ufs_open().
+ * @param buf Buffer to write.
+ * @param size Size of @a buf.
+ * @param offset Offset in the file to write at.
+ *
+ * @retval >= 0 How many bytes were written.
+ * @retval -1 Error occurred. The same codes as of ufs_write().
+ */
+ssize_t
+ufs_pwrite(int fd, const char *buf, size_t size, size_t offset);
+
+/**
+ * Read data from the file at the offset. The descriptor position
+ * is not changed, so threads can share the descriptor.
+ * @param fd File descriptor from ufs_open().
+ * @param buf Buffer to read into.
+ * @param size Maximum bytes to read.
+ * @param offset Offset in the file to read from.
+ *
+ * @retval >= 0 How many bytes were read, 0 if @a offset is at
+ *         or behind the file end.
+ * @retval -1 Error occurred. The same codes as of ufs_read().
+ */
+ssize_t
+ufs_pread(int fd, char *buf, size_t size, size_t offset);
+
+/**
+ * Read data from the file without a copy: get pointers right to
+ * the file memory. The descriptor position moves as by
+ * ufs_read(). The memory stays valid until ufs_read_release() or
+ * ufs_close() on the descriptor, even if the file is truncated
+ * or deleted meanwhile. Data written to the file meanwhile is
+ * visible through it, except for holes and files of up to 64
+ * bytes: those are borrowed as a snapshot, because a write into a
+ * hole or over 64 bytes moves the data to new memory.
+ * @param fd File descriptor from ufs_open().
+ * @param size Maximum bytes to borrow.
+ * @param[out] out Pieces of the file memory, one after another.
+ * @param[in][out] cnt Capacity of @a out on input, number of
+ *        used pieces on output.
+ *
+ * @retval > 0 How many bytes were borrowed. Must be released.
+ * @retval 0 EOF, or @a cnt is 0. Nothing to release.
+ * @retval -1 Error occurred. The same codes as of ufs_read().
+ */
+ssize_t
+ufs_read_borrow(int fd, size_t size, struct iovec *out, int *cnt);
+
+/**
+ * Release memory of one not released ufs_read_borrow() on the
+ * descriptor. Does nothing if there is none.
+ * @param fd File descriptor from ufs_open().
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ */
+int
+ufs_read_release(int fd);
+
+/**
+ * Get the file size, e.g. to append with ufs_pwrite().
+ * @param fd File descriptor from ufs_open().
+ *
+ * @retval >= 0 Size of the file.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ */
+ssize_t
+ufs_size(int fd);
+
 /**
  * Close a file.
  * @param fd File descriptor from ufs_open().
@@ -138,6 +260,234 @@ ufs_close(int fd);
 int
 ufs_delete(const char *filename);
 
+/**
+ * Make a copy of a file under a new name. The copy shares memory
+ * with the source, a piece of it is copied only on the first
+ * write to either file, so cloning a big file is cheap.
+ * @param src Name of a file to copy.
+ * @param dst Name of the copy. An existing file with this name
+ *        is deleted first, as by ufs_delete().
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no file @a src.
+ */
+int
+ufs_clone(const char *src, const char *dst);
+
+/**
+ * Save the state of all the files. Files are cloned as by
+ * ufs_clone(), so a snapshot costs memory only for the data
+ * changed after it.
+ *
+ * @retval >= 0 Snapshot id.
+ */
+int
+ufs_snapshot_create(void);
+
+/**
+ * Bring all the files back to the state of a snapshot. Current
+ * files are deleted as by ufs_delete(), so opened descriptors
+ * keep working with them. The snapshot stays and can be restored
+ * again.
+ * @param id Snapshot id from ufs_snapshot_create().
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no such snapshot.
+ */
+int
+ufs_snapshot_restore(int id);
+
+/**
+ * Delete a snapshot and free the memory only it refers to.
+ * @param id Snapshot id from ufs_snapshot_create().
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no such snapshot.
+ */
+int
+ufs_snapshot_delete(int id);
+
+/**
+ * Save all the files to an image on disk. The image is written
+ * next to @a path and renamed over it, so a crash keeps the old
+ * one. The journal of the image is emptied, whether it is on or
+ * not.
+ * @param path Image path.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_IO - the image can't be written.
+ */
+int
+ufs_save(const char *path);
+
+/**
+ * Replace all the files with the ones from an image, and apply
+ * its journal if there is one. The image is mapped, and file
+ * data is read right from it until it is written, so load time
+ * does not depend on the data size. Current files are deleted as
+ * by ufs_delete().
+ * @param path Image path.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no such image.
+ *     - UFS_ERR_IO - the image is broken. Files are not changed.
+ */
+int
+ufs_load(const char *path);
+
+/**
+ * Save the image as by ufs_save() and start appending changes of
+ * the files to an empty "<path>.journal", so ufs_load() of the
+ * image gets them even if the process dies before the next
+ * ufs_save(). Writes, resizes, creation, deletion and clones are
+ * journaled; a snapshot restore is not, save the image after it.
+ * Records are not synced to the disk, so the journal survives a
+ * crash of the process, but not of the OS or a power loss.
+ *
+ * If a record can't be written, the journal is cut back to the
+ * previous record and stopped. The call which made the change
+ * fails with UFS_ERR_IO, though the change is done in memory.
+ * @param path Image path.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_IO - the image can't be written or the journal
+ *       can't be opened.
+ */
+int
+ufs_journal_start(const char *path);
+
+/** Stop journaling started by ufs_journal_start(). */
+void
+ufs_journal_stop(void);
+
+/** Operations timed by ufs_stats(). */
+enum ufs_op {
+	/** ufs_open(). */
+	UFS_OP_OPEN,
+	/** ufs_read(), ufs_readv(), ufs_pread(), ufs_read_borrow(). */
+	UFS_OP_READ,
+	/** ufs_write(), ufs_writev(), ufs_pwrite(). */
+	UFS_OP_WRITE,
+	/** ufs_resize(). */
+	UFS_OP_RESIZE,
+	/** ufs_delete(). */
+	UFS_OP_DELETE,
+	UFS_OP_COUNT,
+};
+
+/** Calls of one operation since the start, failed ones too. */
+struct ufs_op_stats {
+	uint64_t count;
+	/** Total time of the calls, nanoseconds. */
+	uint64_t total_ns;
+	/** The longest call, nanoseconds. */
+	uint64_t max_ns;
+};
+
+/** Memory usage and activity of the filesystem. */
+struct ufs_stats {
+	/** Files which can be opened. */
+	size_t files;
+	/** Deleted files still kept by open descriptors. */
+	size_t deleted_files;
+	size_t snapshots;
+	size_t descriptors;
+	/** Sum of sizes of the files which can be opened. */
+	size_t file_bytes;
+	/**
+	 * Memory of file data of all the files, deleted and in
+	 * snapshots too. A shared extent is counted once, and a
+	 * compressed one by its compressed size. Small files kept
+	 * right in their records are not counted.
+	 */
+	size_t data_bytes;
+	/** Compressed data, a part of data_bytes. */
+	size_t packed_bytes;
+	/** Images mapped by ufs_load() and still used. */
+	size_t mapped_bytes;
+	/** Extents with memory, in the files which can be opened. */
+	size_t extents;
+	/** Extents shared with clones, snapshots or an image. */
+	size_t shared_extents;
+	/** Extents not written yet, they take no memory. */
+	size_t holes;
+	/** Extents compressed by ufs_compress_tick(). */
+	size_t packed_extents;
+	/** Files small enough to keep data in their record. */
+	size_t inline_files;
+	/** Current block size, see ufs_set_block_size(). */
+	size_t block_size;
+	/** Limit set by ufs_set_memory_limit(), 0 if none. */
+	size_t memory_limit;
+	/** Chunks of the data allocator, with the spare ones. */
+	size_t slab_chunks;
+	/** Empty chunks kept for reuse, their pages given back. */
+	size_t slab_spare_chunks;
+	/** Bytes of the chunks, the spare ones excluded. */
+	size_t slab_chunk_bytes;
+	/**
+	 * Bytes of the chunks given out. The rest of slab_chunk_bytes
+	 * is lost to fragmentation.
+	 */
+	size_t slab_used_bytes;
+	/** Extents too big for chunks, mapped one by one. */
+	size_t slab_big_objects;
+	size_t slab_big_bytes;
+	/** Indexed by enum ufs_op. */
+	struct ufs_op_stats ops[UFS_OP_COUNT];
+};
+
+/**
+ * Get memory usage and operation counters. The numbers are
+ * gathered without stopping other threads, so they are not an
+ * exact snapshot when the filesystem is busy.
+ * @param[out] stats Statistics.
+ */
+void
+ufs_stats(struct ufs_stats *stats);
+
+/**
+ * Limit memory of file data, see ufs_stats::data_bytes. Writes
+ * and resizes which need more memory fail with UFS_ERR_NO_MEM.
+ * Memory used already is not freed when the limit goes below it.
+ * Compressed data is decompressed on access and the journal is
+ * replayed by ufs_load() even over the limit.
+ * @param bytes The limit, 0 to remove it. Default is 0.
+ */
+void
+ufs_set_memory_limit(size_t bytes);
+
+/**
+ * Compress file data which is not used for a while. Every extent
+ * keeps the time of its last read or write by the access clock,
+ * which ticks in ufs_compress_tick(). Extents idle for the given
+ * number of ticks are compressed on the tick, if they get at least
+ * a quarter smaller, and decompressed on the next access. Extents
+ * shared with clones or a loaded image, and files with borrowed
+ * memory, are left as is.
+ * @param idle_ticks Idle ticks before compression, 0 to stop
+ *        compressing. Default is 0. Compressed data stays so until
+ *        it is accessed.
+ */
+void
+ufs_set_compression(unsigned idle_ticks);
+
+/**
+ * Advance the access clock and compress data idle long enough, see
+ * ufs_set_compression(). Call it periodically, e.g. once a minute,
+ * then the idle time is counted in these periods. Files are locked
+ * one by one; creation and deletion of files wait for the tick.
+ * @retval How many extents were compressed.
+ */
+int
+ufs_compress_tick(void);
+
 #ifdef NEED_RESIZE
 
 /**